@@ -67,6 +67,18 @@ void EEMS::initialize_diffs( ) {
   L.topRightCorner(nmin1,nmin1).setIdentity();
   JtDhatJ = MatrixXd::Zero(o,o);
   JtDobsJ = J.transpose()*Diffs*J;
+  // The observed dissimilarities enter the likelihood only through -L*Diffs*L' and its pseudo log
+  // determinant, so compute them once here rather than every time the likelihood is evaluated
+  LDLt = -L*Diffs*L.transpose();
+  FullPivLU<MatrixXd> luLDLt(LDLt);
+  ldLDLt = pseudologdet(LDLt,luLDLt.rank());
+  // -L*Delta*L' = -(L*J)*R*(L*J)' where R is o-by-o, and L*J has rank o-1 because J*1 = 1 and L*1 = 0.
+  // With Q an orthonormal basis for the column space of L*J and T = Q'*L*J, -L*Delta*L' = Q*(-T*R*T')*Q',
+  // so the likelihood can be evaluated with the (o-1)-by-(o-1) matrices -T*R*T' and Q'*(-L*Diffs*L')*Q
+  JacobiSVD<MatrixXd> svdLJ(L*J, ComputeThinU);
+  MatrixXd Q = svdLJ.matrixU().leftCols(o-1);
+  TLJ = Q.transpose()*L*J;
+  QtLDLtQ = Q.transpose()*LDLt*Q;
   cerr << "[Diffs::initialize] Done." << endl << endl;
 }
 void EEMS::initialize_state( ) {
@@ -160,12 +172,15 @@ bool EEMS::start_eems(const MCMC &mcmc) {
   mcmcyCoord.clear();
   mcmcwCoord.clear();
   mcmczCoord.clear();
+  // The full prior also checks that the initial state is in range;
+  // after that, the moves update the prior incrementally
+  eval_prior( );
   nowpi = eems2_prior(nowmSeeds,nowmEffcts,nowmrateMu,nowmrateS2,
 		      nowqSeeds,nowqEffcts,nowqrateMu,nowqrateS2,
 		      nowdf);
-  nowll = eems2_likelihood(nowmSeeds, nowmEffcts, nowmrateMu,
-			   nowqSeeds, nowqEffcts, nowqrateMu,
-			   nowdf);
+  calc_resistance(nowmColors,nowmEffcts,nowmrateMu,nowR);
+  calc_wishart_terms(nowR,nowrDelta,nowldDelta,nowtriDeltaQD);
+  nowll = eems2_wishpdfln(nowrDelta,nowldDelta,nowtriDeltaQD,nowdf);
   cerr << "Input parameters: " << endl << params << endl
        << "Initial log prior: " << nowpi << endl
        << "Initial log llike: " << nowll << endl << endl;
@@ -200,17 +215,33 @@ MoveType EEMS::choose_move_type( ) {
   return(move);
 }
 double EEMS::eval_proposal_rate_one_mtile(Proposal &proposal) const {
-  return(eems2_likelihood(nowmSeeds, proposal.newmEffcts, nowmrateMu, nowqSeeds, nowqEffcts, nowqrateMu, nowdf));
+  calc_resistance(nowmColors,proposal.newmEffcts,nowmrateMu,proposal.newR);
+  calc_wishart_terms(proposal.newR,proposal.newrDelta,proposal.newldDelta,proposal.newtriDeltaQD);
+  return(eems2_wishpdfln(proposal.newrDelta,proposal.newldDelta,proposal.newtriDeltaQD,nowdf));
 }
 double EEMS::eval_proposal_overall_mrate(Proposal &proposal) const {
-  return(eems2_likelihood(nowmSeeds, nowmEffcts, proposal.newmrateMu, nowqSeeds, nowqEffcts, nowqrateMu, nowdf));
+  // All migration rates are scaled by the same factor c, so the resistance distances are scaled by 1/c,
+  // and so is -L*Delta*L'. Then its rank does not change, its pseudo log determinant decreases by
+  // rank*log(c) and trace(pinv(-L*Delta*L')*(-L*Diffs*L')) is multiplied by c
+  double c = pow(10.0,proposal.newmrateMu - nowmrateMu);
+  proposal.newR = nowR / c;
+  proposal.newrDelta = nowrDelta;
+  proposal.newldDelta = nowldDelta - nowrDelta*log(c);
+  proposal.newtriDeltaQD = nowtriDeltaQD * c;
+  return(eems2_wishpdfln(proposal.newrDelta,proposal.newldDelta,proposal.newtriDeltaQD,nowdf));
 }
 // Propose to move one tile in the migration Voronoi tessellation
 double EEMS::eval_proposal_move_one_mtile(Proposal &proposal) const {
-  return(eems2_likelihood(proposal.newmSeeds, nowmEffcts, nowmrateMu, nowqSeeds, nowqEffcts, nowqrateMu, nowdf));
+  graph.index_closest_to_deme(proposal.newmSeeds,proposal.newmColors);
+  calc_resistance(proposal.newmColors,nowmEffcts,nowmrateMu,proposal.newR);
+  calc_wishart_terms(proposal.newR,proposal.newrDelta,proposal.newldDelta,proposal.newtriDeltaQD);
+  return(eems2_wishpdfln(proposal.newrDelta,proposal.newldDelta,proposal.newtriDeltaQD,nowdf));
 }
 double EEMS::eval_birthdeath_mVoronoi(Proposal &proposal) const {
-  return(eems2_likelihood(proposal.newmSeeds, proposal.newmEffcts, nowmrateMu, nowqSeeds, nowqEffcts, nowqrateMu, nowdf));
+  graph.index_closest_to_deme(proposal.newmSeeds,proposal.newmColors);
+  calc_resistance(proposal.newmColors,proposal.newmEffcts,nowmrateMu,proposal.newR);
+  calc_wishart_terms(proposal.newR,proposal.newrDelta,proposal.newldDelta,proposal.newtriDeltaQD);
+  return(eems2_wishpdfln(proposal.newrDelta,proposal.newldDelta,proposal.newtriDeltaQD,nowdf));
 }
 void EEMS::propose_df(Proposal &proposal,const MCMC &mcmc) {
   proposal.move = DF_UPDATE;
@@ -225,12 +256,10 @@ void EEMS::propose_df(Proposal &proposal,const MCMC &mcmc) {
     //double newdf_2 = 0.5 * newdf;
     if ( (newdf>params.dfmin) && (newdf<params.dfmax) ) {
       proposal.newdf = newdf;
-      proposal.newpi = eems2_prior(nowmSeeds,nowmEffcts,nowmrateMu,nowmrateS2,
-				   nowqSeeds,nowqEffcts,nowqrateMu,nowqrateS2,
-				   newdf);
-      proposal.newll = eems2_likelihood(nowmSeeds, nowmEffcts, nowmrateMu,
-					nowqSeeds, nowqEffcts, nowqrateMu,
-					newdf);
+      // The prior on df is proportional to 1/df
+      proposal.newpi = nowpi + log(nowdf) - log(newdf);
+      // Only the degrees of freedom change, so reuse the precomputed components of the likelihood
+      proposal.newll = eems2_wishpdfln(nowrDelta,nowldDelta,nowtriDeltaQD,newdf);
     }
   }
 }
@@ -249,9 +278,7 @@ void EEMS::propose_rate_one_mtile(Proposal &proposal) {
   //  - dtrnormln(nowmEffct,0.0,nowmrateS2,params.mEffctHalfInterval) : old prior component associated with this tile
   //  + dtrnormln(newmEffct,0.0,nowmrateS2,params.mEffctHalfInterval) : new prior component associated with this tile
   if ( abs(newmEffct) < params.mEffctHalfInterval ) {
-    proposal.newpi = eems2_prior(nowmSeeds,proposal.newmEffcts,nowmrateMu,nowmrateS2,
-				 nowqSeeds,nowqEffcts,nowqrateMu,nowqrateS2,
-				 nowdf);
+    proposal.newpi = nowpi - dtrnorm_mEffct(curmEffct) + dtrnorm_mEffct(newmEffct);
     proposal.newll = eval_proposal_rate_one_mtile(proposal);
   } else {
     proposal.newpi = -Inf;
@@ -314,13 +341,10 @@ void EEMS::propose_birthdeath_mVoronoi(Proposal &proposal) {
     proposal.newratioln = log(pDeath/pBirth)
       - dtrnormln(newmEffct,nowmEffct,params.mEffctProposalS2,params.mEffctHalfInterval);
 
-    // Two ways to get the new log prior, newpi. Should give the same answer.
-    //proposal.newpi = nowpi
-    //  + log((nowmtiles+params.negBiSize)/(newmtiles/params.negBiProb))
-    //  + dtrnormln(newmEffct,0.0,nowmrateS2,params.mEffctHalfInterval);
-    proposal.newpi = eems2_prior(proposal.newmSeeds,proposal.newmEffcts,nowmrateMu,nowmrateS2,
-				 nowqSeeds,nowqEffcts,nowqrateMu,nowqrateS2,
-				 nowdf);
+    // The new tile changes the prior on the number of tiles and adds one effect
+    proposal.newpi = nowpi
+      + log((nowmtiles+params.negBiSize)/(newmtiles/params.negBiProb))
+      + dtrnorm_mEffct(newmEffct);
   } else {                       // Propose death
     if (nowmtiles==2) { pBirth = 1.0; }
     newmtiles--;
@@ -335,13 +359,10 @@ void EEMS::propose_birthdeath_mVoronoi(Proposal &proposal) {
     proposal.newratioln = log(pBirth/pDeath)
       + dtrnormln(oldmEffct,nowmEffct,params.mEffctProposalS2,params.mEffctHalfInterval);
 
-    // Two ways to get the new log prior, newpi. Should give the same answer.
-    //proposal.newpi = nowpi
-    //  + log((nowmtiles/params.negBiProb)/(newmtiles+params.negBiSize))
-    //  - dtrnormln(oldmEffct,0.0,nowmrateS2,params.mEffctHalfInterval);
-    proposal.newpi = eems2_prior(proposal.newmSeeds,proposal.newmEffcts,nowmrateMu,nowmrateS2,
-				 nowqSeeds,nowqEffcts,nowqrateMu,nowqrateS2,
-				 nowdf);
+    // The removed tile changes the prior on the number of tiles and removes one effect
+    proposal.newpi = nowpi
+      + log((nowmtiles/params.negBiProb)/(newmtiles+params.negBiSize))
+      - dtrnorm_mEffct(oldmEffct);
   }
   proposal.move = M_VORONOI_BIRTH_DEATH;
   proposal.newmtiles = newmtiles;
@@ -352,9 +373,27 @@ void EEMS::update_hyperparams( ) {
   double SSm = nowmEffcts.squaredNorm();
   nowqrateS2 = draw.rinvgam(params.qrateShape_2 + 0.5 * nowqtiles, params.qrateScale_2 + 0.5 * SSq);
   nowmrateS2 = draw.rinvgam(params.mrateShape_2 + 0.5 * nowmtiles, params.mrateScale_2 + 0.5 * SSm);
-  nowpi = eems2_prior(nowmSeeds,nowmEffcts,nowmrateMu,nowmrateS2,
-		      nowqSeeds,nowqEffcts,nowqrateMu,nowqrateS2,
-		      nowdf);
+  eval_prior( );
+}
+void EEMS::eval_prior( ) {
+  // The variances nowmrateS2 and nowqrateS2 change only in update_hyperparams,
+  // so the normalizing constants of the truncated normal priors are computed once per update
+  nowmtrnormln = trnormconstln(nowmrateS2,params.mEffctHalfInterval);
+  nowqtrnormln = trnormconstln(nowqrateS2,params.qEffctHalfInterval);
+  // The seeds and the effects are always in range (proposals outside their support are rejected),
+  // so the prior is the same as eems2_prior at the current state
+  nowpi = - log(nowdf)
+    + dnegbinln(nowmtiles,params.negBiSize,params.negBiProb)
+    + dnegbinln(nowqtiles,params.negBiSize,params.negBiProb)
+    + dinvgamln(nowmrateS2,params.mrateShape_2,params.mrateScale_2)
+    + dinvgamln(nowqrateS2,params.qrateShape_2,params.qrateScale_2)
+    + nowqtiles * nowqtrnormln - 0.5 * nowqEffcts.squaredNorm() / nowqrateS2
+    + nowmtiles * nowmtrnormln - 0.5 * nowmEffcts.squaredNorm() / nowmrateS2;
+}
+// Same as dtrnormln(mEffct,0.0,nowmrateS2,params.mEffctHalfInterval) but with the normalizing constant precomputed
+double EEMS::dtrnorm_mEffct(const double mEffct) const {
+  if (abs(mEffct) > params.mEffctHalfInterval) { return (-Inf); }
+  return (nowmtrnormln - 0.5 * mEffct * mEffct / nowmrateS2);
 }
 bool EEMS::accept_proposal(Proposal &proposal) {
   double u = draw.runif( );
@@ -381,14 +420,14 @@ bool EEMS::accept_proposal(Proposal &proposal) {
     case M_VORONOI_POINT_MOVE:
       nowmSeeds = proposal.newmSeeds;
       // Update the mapping of demes to mVoronoi tiles
-      graph.index_closest_to_deme(nowmSeeds,nowmColors);
+      nowmColors = proposal.newmColors;
       break;
     case M_VORONOI_BIRTH_DEATH:
       nowmSeeds = proposal.newmSeeds;
       nowmEffcts = proposal.newmEffcts;
       nowmtiles = proposal.newmtiles;
       // Update the mapping of demes to mVoronoi tiles
-      graph.index_closest_to_deme(nowmSeeds,nowmColors);
+      nowmColors = proposal.newmColors;
       break;
     case DF_UPDATE:
       nowdf = proposal.newdf;
@@ -397,6 +436,13 @@ bool EEMS::accept_proposal(Proposal &proposal) {
       cerr << "[RJMCMC] Unknown move type" << endl;
       exit(1);
     }
+    // All moves except the degrees of freedom update change the resistance distances
+    if (proposal.move != DF_UPDATE) {
+      nowR = proposal.newR;
+      nowrDelta = proposal.newrDelta;
+      nowldDelta = proposal.newldDelta;
+      nowtriDeltaQD = proposal.newtriDeltaQD;
+    }
     nowpi = proposal.newpi;
     nowll = proposal.newll;
     return true;
@@ -406,6 +452,22 @@ bool EEMS::accept_proposal(Proposal &proposal) {
     return false;
   }
 }
+// The proposals update the likelihood from the cached resistance distances and Wishart components,
+// so check that the current prior and likelihood agree with the full computation
+void EEMS::check_ll_computation( ) const {
+  double pi0 = eems2_prior(nowmSeeds,nowmEffcts,nowmrateMu,nowmrateS2,
+			   nowqSeeds,nowqEffcts,nowqrateMu,nowqrateS2,
+			   nowdf);
+  double ll0 = eems2_likelihood(nowmSeeds,nowmEffcts,nowmrateMu,nowdf);
+  VectorXi mColors;
+  graph.index_closest_to_deme(nowmSeeds,mColors);
+  if ((abs(nowpi - pi0) > 1e-10 * abs(pi0)) || (abs(nowll - ll0) > 1e-10 * abs(ll0)) || (mColors != nowmColors)) {
+    cerr << "[EEMS::check_ll_computation] The current state is inconsistent:" << endl
+	 << "  Log prior = " << nowpi << " (expected " << pi0 << ")" << endl
+	 << "  Log llike = " << nowll << " (expected " << ll0 << ")" << endl;
+    exit(1);
+  }
+}
 ///////////////////////////////////////////
 void EEMS::print_iteration(const MCMC &mcmc) const {
   cerr << " Ending iteration " << mcmc.currIter
@@ -447,17 +509,9 @@ void EEMS::save_iteration(const MCMC &mcmc) {
     mcmcyCoord.push_back(nowmSeeds(t,1));
   }
   /////////////////////////
-  MatrixXd M = MatrixXd::Zero(d,d);
-  int alpha, beta;
-  // Transform the log10 migration parameters into migration rates on the original scale
-  for ( int edge = 0 ; edge < graph.get_num_edges() ; edge++ ) {
-    graph.get_edge(edge,alpha,beta);
-    double log10m_alpha = nowmEffcts(nowmColors(alpha)) + nowmrateMu;
-    double log10m_beta = nowmEffcts(nowmColors(beta)) + nowmrateMu;
-    M(alpha,beta) = 0.5 * pow(10.0,log10m_alpha) + 0.5 * pow(10.0,log10m_beta);
-    M(beta,alpha) = M(alpha,beta);
-  }  
-  JtDhatJ += resistance_distance(M,o);
+  // nowR is the resistance distance for the migration rates M * Binvconst,
+  // so it is the resistance distance for M divided by Binvconst
+  JtDhatJ += nowR * Binvconst;
 }
 bool EEMS::output_current_state( ) const {
   ofstream out; bool error = false;
@@ -600,25 +654,23 @@ double EEMS::eems2_prior(const MatrixXd &mSeeds, const VectorXd &mEffcts, const
   return (logpi);
 }
 double EEMS::eems2_likelihood(const MatrixXd &mSeeds, const VectorXd &mEffcts, const double mrateMu,
-			      const MatrixXd &qSeeds, const VectorXd &qEffcts, const double qrateMu,
 			      const double df) const {
-
-  double sigma2 = 1.0;
-  
   // mSeeds, mEffcts and mrateMu define the migration Voronoi tessellation
-  // qSeeds, qEffcts define the diversity Voronoi tessellation
-  // These are EEMS parameters, so no need to pass them to test_likelihood
-  VectorXi mColors, qColors;
+  // The diversity rates do not enter the likelihood of the between-demes dissimilarities
+  VectorXi mColors;
   // For every deme in the graph -- which migration tile does the deme fall into? 
   graph.index_closest_to_deme(mSeeds,mColors);
-  // For every deme in the graph -- which diversity tile does the deme fall into? 
-  graph.index_closest_to_deme(qSeeds,qColors);
-  VectorXd W = VectorXd::Zero(d);
-  // Transform the log10 diversity parameters into diversity rates on the original scale
-  for ( int alpha = 0 ; alpha < d ; alpha++ ) {
-    double log10q_alpha = qEffcts(qColors(alpha)); // qrateMu = 0.0
-    W(alpha) = pow(10.0,log10q_alpha);
-  }
+  MatrixXd R;
+  calc_resistance(mColors,mEffcts,mrateMu,R);
+  // This is the full computation, at the level of individuals, which check_ll_computation compares
+  // with the current likelihood. J is an indicator matrix such that J(i,a) = 1 if individual i comes
+  // from deme a, and J(i,a) = 0 otherwise
+  MatrixXd Delta = J*R*J.transpose();
+  return (pseudowishpdfln(LDLt,ldLDLt,-L*Delta*L.transpose()/df,df));
+}
+// The resistance distances between observed demes, for the migration rates (scaled by Binvconst)
+// of the Voronoi tessellation given by mColors, mEffcts and mrateMu
+void EEMS::calc_resistance(const VectorXi &mColors, const VectorXd &mEffcts, const double mrateMu, MatrixXd &R) const {
   MatrixXd M = MatrixXd::Zero(d,d);
   int alpha, beta;
   // Transform the log10 migration parameters into migration rates on the original scale
@@ -629,10 +681,33 @@ double EEMS::eems2_likelihood(const MatrixXd &mSeeds, const VectorXd &mEffcts, c
     M(alpha,beta) = 0.5 * pow(10.0,log10m_alpha) + 0.5 * pow(10.0,log10m_beta);
     M(beta,alpha) = M(alpha,beta);
   }
-  // J is an indicator matrix such that J(i,a) = 1 if individual i comes from deme a,
-  // and J(i,a) = 0 otherwise  
-  MatrixXd Delta = expected_between_dissimilarities(J, M * Binvconst);
-  double logll = pseudowishpdfln(-L*Diffs*L.transpose(),
-				 -L*Delta*L.transpose()*sigma2/df,df);
-  return (logll);
+  R = resistance_distance(M * Binvconst, o);
+}
+/*
+  The components of the Wishart log likelihood that do not depend on the degrees of freedom:
+  the rank rDelta and the pseudo log determinant ldDelta of -L*Delta*L', where Delta = J*R*J',
+  and triDeltaQD = trace(pinv(-L*Delta*L')*(-L*Diffs*L')). These are computed at the level of demes,
+  as -L*Delta*L' = Q*(-T*R*T')*Q' (see initialize_diffs), so the cost depends on the number of
+  observed demes rather than on the number of individuals
+*/
+void EEMS::calc_wishart_terms(const MatrixXd &R, int &rDelta, double &ldDelta, double &triDeltaQD) const {
+  LLT<MatrixXd> llt(-TLJ*R*TLJ.transpose());
+  if (llt.info() == Success) {
+    rDelta = o - 1;
+    ldDelta = 2.0 * llt.matrixLLT().diagonal().array().log().sum();
+    triDeltaQD = llt.solve(QtLDLtQ).trace();
+    return;
+  }
+  // -T*R*T' is numerically singular, so fall back to the computation at the level of individuals
+  MatrixXd Sigma = -L*J*R*J.transpose()*L.transpose();
+  FullPivLU<MatrixXd> lu(Sigma);
+  rDelta = lu.rank();
+  ldDelta = pseudologdet(Sigma,rDelta);
+  triDeltaQD = (pinv(Sigma) * LDLt).trace();
+}
+// The Wishart log likelihood of -L*Diffs*L' with scale matrix Sigma = -L*Delta*L'/df
+double EEMS::eems2_wishpdfln(const int rDelta, const double ldDelta, const double triDeltaQD, const double df) const {
+  // Sigma has the same rank as -L*Delta*L', pseudo log determinant ldDelta - rDelta*log(df)
+  // and trace(pinv(Sigma)*(-L*Diffs*L')) = df*triDeltaQD
+  return (pseudowishpdfln(ldLDLt,nmin1,ldDelta - rDelta*log(df),rDelta,df*triDeltaQD,df));
 }
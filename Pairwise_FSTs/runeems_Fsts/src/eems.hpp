@@ -33,7 +33,8 @@ struct Proposal {
   double newll; // log likelihood
   double newratioln; // RJ-MCMC proposal ratio, on the log scale
   double newmrateMu; // overall (mean) migration rate, on the log10 scale; qrateMu is assumed to be 0
-  double newtriDeltaQD; // two precomputed components of the Wishart log likelihood
+  double newtriDeltaQD, newldDelta; int newrDelta; // three precomputed components of the Wishart log likelihood
+  MatrixXd newR; // the resistance distances between observed demes
   VectorXd newqEffcts; // the diversity rate of each q tile, on the log10 scale
   VectorXd newmEffcts; // the migration rate of each m tile, on the log10 scale and relative to the ovarall mrateMu
   MatrixXd newqSeeds;  // the location of each q tile within the habitat
@@ -55,7 +56,6 @@ public:
 		     const MatrixXd &qSeeds, const VectorXd &qEffcts, const double qrateMu, const double qrateS2,
 		     const double df) const;
   double eems2_likelihood(const MatrixXd &mSeeds, const VectorXd &mEffcts, const double mrateMu,
-			  const MatrixXd &qSeeds, const VectorXd &qEffcts, const double qrateMu,
 			  const double df) const;
   MoveType choose_move_type( );
   // These functions change the between demes component:
@@ -102,6 +102,10 @@ private:
   VectorXd cvec; // c is the vector of counts
   MatrixXd JtDobsJ;
   MatrixXd JtDhatJ;
+  MatrixXd LDLt; // -L*Diffs*L'
+  double ldLDLt; // pseudo logdet(-L*Diffs*L')
+  MatrixXd TLJ; // Q'*L*J, where Q is an orthonormal basis for the column space of L*J
+  MatrixXd QtLDLtQ; // Q'*(-L*Diffs*L')*Q
   double n_2, logn; int nmin1; // n/2, log(n), n-1
   void initialize_diffs();
   void randpoint_in_habitat(MatrixXd &Seeds);
@@ -115,10 +119,19 @@ private:
   double nowpi, nowll, nowdf; // variance scale, log prior, log likelihood, degrees of freedom
   VectorXi nowqColors; // mapping that indicates which q tiles each vertex/deme falls into
   VectorXi nowmColors; // mapping that indicates which m tiles each vertex/deme falls into
+  MatrixXd nowR; // the resistance distances between observed demes, for the migration rates M * Binvconst
+  double nowtriDeltaQD, nowldDelta; int nowrDelta; // three precomputed components of the Wishart log likelihood
+  double nowmtrnormln, nowqtrnormln; // log normalizing constants of the truncated normal priors on nowmEffcts and nowqEffcts
 
   // Fixed constants -- necessary to scale diploid and haploid species slightly differently
   double Wconst, Binvconst;
 
+  void calc_resistance(const VectorXi &mColors, const VectorXd &mEffcts, const double mrateMu, MatrixXd &R) const;
+  void calc_wishart_terms(const MatrixXd &R, int &rDelta, double &ldDelta, double &triDeltaQD) const;
+  double eems2_wishpdfln(const int rDelta, const double ldDelta, const double triDeltaQD, const double df) const;
+  void eval_prior( );
+  double dtrnorm_mEffct(const double mEffct) const;
+
   // Variables to store the results in :
   // Fixed size:
   MatrixXd mcmcmhyper;
@@ -82,6 +82,7 @@ int main(int argc, char** argv)
 	
       mcmc.add_to_total_moves(proposal.move);
       if (eems.accept_proposal(proposal)) { mcmc.add_to_okay_moves(proposal.move); }
+      if (params.testing) { eems.check_ll_computation( ); }
       
       eems.update_hyperparams( );
       mcmc.end_iteration( );
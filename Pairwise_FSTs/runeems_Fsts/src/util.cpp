@@ -34,7 +34,8 @@ Params::Params(const string &params_file, const long seed_from_command_line) {
       ("mrateScale", po::value<double>(&mrateScale_2)->default_value(1.0), "mrateScale")
       ("sigmaScale", po::value<double>(&sigmaScale_2)->default_value(1.0), "sigmaScale")
       ("negBiProb", po::value<double>(&negBiProb)->default_value(0.67), "negBiProb")
-      ("negBiSize", po::value<int>(&negBiSize)->default_value(10), "negBiSize") ;
+      ("negBiSize", po::value<int>(&negBiSize)->default_value(10), "negBiSize")
+      ("testing", po::value<bool>(&testing)->default_value(false), "testing") ;
     ifstream instrm(params_file.c_str());
     po::variables_map vm;
     po::store(po::parse_config_file(instrm,eems_options,true),vm);
@@ -61,8 +62,8 @@ Params::Params(const string &params_file, const long seed_from_command_line) {
     If testing = true, then the function check_ll_computation() will be called after each MCMC iteration,
     and it will check that the current prior, nowpi, is the same as test_prior(current parameters)
     as well as that the currrent likelihood, nowll, is the same as test_likelihood(current parameters)
+    Set testing = true in the parameter file to run these checks
    */
-  testing = false;
   mEffctHalfInterval = 2.0;
   qEffctHalfInterval = 0.1;
   mrateMuHalfInterval = 2.4771; // log10(300)
@@ -251,14 +252,22 @@ MatrixXd pinv(const MatrixXd& m) {
 }
 double pseudowishpdfln(const MatrixXd &X, const MatrixXd &Sigma, const int df) {
   FullPivLU<MatrixXd> luX(X);
-  FullPivLU<MatrixXd> luS(Sigma);
   int rX = luX.rank();
+  return (pseudowishpdfln(X,pseudologdet(X,rX),Sigma,df));
+}
+// The same density, given the pseudo log determinant ldX of X. ldX depends only on the data,
+// so it can be computed once rather than for every value of Sigma
+double pseudowishpdfln(const MatrixXd &X, const double ldX, const MatrixXd &Sigma, const int df) {
+  FullPivLU<MatrixXd> luS(Sigma);
   int rS = luS.rank();
-  double ldX = pseudologdet(X,rX);
   double ldS = pseudologdet(Sigma,rS);
-  int n = X.rows( );
+  return (pseudowishpdfln(ldX,X.rows(),ldS,rS,(pinv(Sigma) * X).trace(),df));
+}
+// The same density, in terms of the pseudo log determinant ldX of the n-by-n matrix X,
+// the pseudo log determinant ldS and the rank rS of Sigma, and trSX = trace(pinv(Sigma)*X)
+double pseudowishpdfln(const double ldX, const int n, const double ldS, const int rS, const double trSX, const int df) {
   int q = (df<rS) ? df : rS;
-  return (0.5*(-df*ldS - (pinv(Sigma) * X).trace() +
+  return (0.5*(-df*ldS - trSX +
 	       (df-n-1.0)*ldX - df*rS*log_2 + df*(q-rS)*log_pi) - mvgammaln(0.5*df,q));
 }
 double mvgammaln(const double a, const int p) {
@@ -307,7 +316,10 @@ MatrixXd pairwise_distance(const MatrixXd &X, const MatrixXd &Y) {
 MatrixXd resistance_distance(const MatrixXd &M, const int o) {
   MatrixXd Hinv = - M; Hinv.diagonal() += M.rowwise().sum();
   Hinv.array() += 1.0;
-  MatrixXd H = Hinv.inverse().topLeftCorner(o,o);
+  // Hinv is the graph Laplacian plus 1*1', which is positive definite if the graph is connected,
+  // and only the block of its inverse that corresponds to the observed demes is necessary
+  int d = Hinv.rows();
+  MatrixXd H = Hinv.llt().solve(MatrixXd::Identity(d,o)).topRows(o);
   MatrixXd R = - 2.0*H;
   VectorXd u_o = VectorXd::Ones(o);
   R.noalias() += H.diagonal()*u_o.transpose();
@@ -332,30 +344,106 @@ MatrixXd expected_between_dissimilarities(const MatrixXd &J, const MatrixXd &M)
   MatrixXd Delta = J*resistance_distance(M,o)*J.transpose();
   return (Delta);
 }
-// Read a matrix, with unknown dimensions, from a text file
-// Return an empty matrix (0 rows, 0 columns) if there is an error
+/*
+  Parse a decimal number (an optional sign, digits with an optional decimal point and an optional
+  exponent) that starts at pos, directly from the mapped file and independently of the locale.
+  Up to 19 significant digits are collected into an integer; if it and the power of ten are both
+  exactly representable as doubles, a single multiplication or division gives the correctly rounded
+  result, as strtod would. The other (rare) numbers are converted by a stream in the "C" locale.
+  Returns false if there is no number at pos. Afterwards pos points just after the number
+ */
+static bool parse_number(const char *&pos, const char *end, double &number) {
+  static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+				    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+  const char *start = pos;
+  bool negative = false;
+  if (pos < end && (*pos == '-' || *pos == '+')) { negative = (*pos == '-'); pos++; }
+  const char *unsigned_start = pos;
+  uint64_t mantissa = 0;
+  int digits = 0, exponent = 0;
+  bool exact = true, seen = false;
+  for (bool point = false ; pos < end ; pos++) {
+    if (*pos == '.' && !point) { point = true; continue; }
+    if (*pos < '0' || *pos > '9') { break; }
+    seen = true;
+    if (mantissa || *pos != '0') { digits++; }
+    if (digits <= 19) {
+      mantissa = 10 * mantissa + (*pos - '0');
+      if (point) { exponent--; }
+    } else {
+      // Further digits are dropped, so the fast path below does not apply
+      if (*pos != '0') { exact = false; }
+      if (!point) { exponent++; }
+    }
+  }
+  if (!seen) { pos = start; return false; }
+  if (pos < end && (*pos == 'e' || *pos == 'E')) {
+    pos++;
+    bool negexp = false;
+    if (pos < end && (*pos == '-' || *pos == '+')) { negexp = (*pos == '-'); pos++; }
+    if (pos == end || *pos < '0' || *pos > '9') { pos = start; return false; }
+    int e = 0;
+    for ( ; pos < end && *pos >= '0' && *pos <= '9' ; pos++) { if (e < 100000) { e = 10 * e + (*pos - '0'); } }
+    exponent += negexp ? -e : e;
+  }
+  if (exact && mantissa < (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+    number = (double)mantissa;
+    number = (exponent < 0) ? number / powers[-exponent] : number * powers[exponent];
+  } else {
+    istringstream in(string(unsigned_start, pos));
+    in.imbue(locale::classic());
+    in >> number;
+    if (in.fail()) { pos = start; return false; }
+  }
+  if (negative) { number = -number; }
+  return true;
+}
+// Parse one line of whitespace-separated numbers, starting at pos, into row.
+// Returns false if the line contains anything other than numbers. Afterwards pos points to the next line
+static bool parse_line(const char *&pos, const char *end, vector<double> &row) {
+  row.clear();
+  const char *eol = static_cast<const char*>(memchr(pos, '\n', end - pos));
+  if (!eol) { eol = end; }
+  bool valid = true;
+  while (pos < eol) {
+    while (pos < eol && isspace((unsigned char)*pos)) { pos++; }
+    if (pos == eol) { break; }
+    double number;
+    if (!parse_number(pos, eol, number) || (pos < eol && !isspace((unsigned char)*pos))) { valid = false; break; }
+    row.push_back(number);
+  }
+  pos = (eol < end) ? eol + 1 : end;
+  return valid;
+}
+/*
+  Read a matrix of numbers, with unknown dimensions, one row per line. The file is mapped into memory
+  and read once: the first line determines the number of columns and the number of lines determines
+  the number of rows, so the matrix is allocated only once. Returns an empty matrix (0 rows, 0 columns)
+  if the file cannot be opened or if the rows are not all of the same length.
+ */
 MatrixXd readMatrixXd(const string &filename) {
-  ifstream instrm(filename.c_str(), ios::in);
-  if (!instrm.is_open( )) { return (MatrixXd::Zero(0,0)); }
-  string line; getline(instrm,line);
-  boost::algorithm::trim(line);
+  boost::iostreams::mapped_file_source file;
+  try {
+    file.open(filename);
+  } catch (exception &e) {
+    return (MatrixXd::Zero(0,0));
+  }
+  if (!file.is_open() || !file.size()) { return (MatrixXd::Zero(0,0)); }
+  const char *pos = file.data(), *end = file.data() + file.size();
+  int rows = count(pos, end, '\n');
+  if (end[-1] != '\n') { rows++; }
+  vector<double> row;
   // Split the first line into numbers
-  VectorXd row = split(line);
   // This tells us the number of columns
+  if (!parse_line(pos,end,row) || row.empty()) { return (MatrixXd::Zero(0,0)); }
   int cols = row.size();
-  if (!cols) { return (MatrixXd::Zero(0,0)); }
-  MatrixXd mat(1,cols); mat.row(0) = row;
-  while (getline(instrm,line)) {
-    boost::algorithm::trim(line);
-    row = split(line);
-    if (row.size()==cols) {
-      // Resize the matrix to add each row (done once at the start of EEMS, so okay)
-      insertRow(mat,row);
-    } else {
-      return (MatrixXd::Zero(0,0));
-    }
+  MatrixXd mat(rows,cols);
+  mat.row(0) = RowVectorXd::Map(&row[0],cols);
+  for ( int i = 1 ; i < rows ; i++ ) {
+    if (!parse_line(pos,end,row) || (int)row.size() != cols) { return (MatrixXd::Zero(0,0)); }
+    mat.row(i) = RowVectorXd::Map(&row[0],cols);
   }
-  return(mat);
+  return (mat);
 }
 double trace_AxB(const MatrixXd &A, const MatrixXd &B) {
   return (A.cwiseProduct(B).sum());
@@ -467,6 +555,19 @@ double dtrnormln(const double x, const double mu, const double sigma2, const dou
   }
   return (pln);
 }
+/*
+  Log normalizing constant of the truncated normal distribution with mean 0 and support [-bnd,+bnd],
+  so that dtrnormln(x,0.0,sigma2,bnd) = trnormconstln(sigma2,bnd) - 0.5 * x * x / sigma2
+  It depends only on the variance, so it can be computed once for every value of sigma2
+*/
+double trnormconstln(const double sigma2, const double bnd) {
+  double cln = -Inf;
+  if (sigma2>0) {
+    boost::math::normal pnorm(0.0,sqrt(sigma2));
+    cln = - 0.5 * log(sigma2) - log(cdf(pnorm,bnd) - cdf(pnorm,-bnd));
+  }
+  return (cln);
+}
 VectorXd slice(const VectorXd &A, const VectorXi &I) {
   int elems = I.size();
   VectorXd B(elems);
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
 #include <vector>
 #include <limits>
 #include <iomanip>
@@ -26,6 +29,7 @@ using namespace Eigen;
 #include <boost/program_options/detail/config_file.hpp>
 #include <boost/math/distributions/normal.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 namespace po = boost::program_options;
 
 #ifndef UTIL_H
@@ -73,6 +77,8 @@ bool isposdef(const MatrixXd &A);
 double logdet(const MatrixXd &A);
 double pseudologdet(const MatrixXd &A, const int r);
 double pseudowishpdfln(const MatrixXd &X, const MatrixXd &Sigma, const int df);
+double pseudowishpdfln(const MatrixXd &X, const double ldX, const MatrixXd &Sigma, const int df);
+double pseudowishpdfln(const double ldX, const int n, const double ldS, const int rS, const double trSX, const int df);
 double mvgammaln(const double a, const int p);
 double wishpdfln(const MatrixXd &X, const MatrixXd &Sigma, const double df);
 MatrixXd pairwise_distance(const MatrixXd &X, const MatrixXd &Y);
@@ -92,6 +98,7 @@ double dnegbinln(const int k, const int size, const double prob);
 double dinvgamln(const double x, const double shape, const double scale);
 double dmvnormln(const VectorXd &x, const VectorXd &mu, const MatrixXd &sigma);
 double dtrnormln(const double x, const double mu, const double sigma2, const double bnd);
+double trnormconstln(const double sigma2, const double bnd);
 
 VectorXd slice(const VectorXd &A, const VectorXi &I);
 MatrixXd slice(const MatrixXd &A, const VectorXi &R, const VectorXi &C);
@@ -4,9 +4,13 @@
 #include "data.hpp"
 
 static void show_usage( ) {
-  std::cerr << "Usage: bed2diffs_v2 --bfile PlinkData\n"
+  std::cerr << "Usage: bed2diffs_v2 --bfile PlinkData (or --vcf VcfFile)\n"
 	    << "Options:\n"
-	    << "  --nthreads K\tSet the number of OpenMP threads"
+	    << "  --nthreads K\tSet the number of OpenMP threads\n"
+	    << "  --memory M\tCompute the matrix in bands of rows, using at most about M megabytes\n"
+	    << "  --vcf VcfFile\tRead the genotypes from a VCF file (.vcf or .vcf.gz) instead of plink files\n"
+	    << "  --binary\tWrite the matrix in binary format to PlinkData.diffs.bin\n"
+	    << "  --gemm\tCompute the differences with a blocked matrix product"
 	    << std::endl;
 }
 
@@ -14,8 +18,12 @@ static void show_usage( ) {
 int main(int argc, char * argv[])
 {
   
-  std::string bfilepath;
+  std::string datapath;
+  bool vcf = false;
   int nthreads = 1;
+  bool binary = false;
+  size_t memoryMB = 0;
+  bool gemm = false;
 
   ////////////////////////////////////////////////////////////////////////////////
   // Parse commandline arguments
@@ -23,9 +31,17 @@ int main(int argc, char * argv[])
   for (int i = 1 ; i < argc ; i++ ) {
     std::string arg = argv[i];
     if (arg == "--bfile") {
-      if (i+1<argc) { bfilepath.append(argv[++i]); } else { show_usage( ); return EXIT_FAILURE; }
+      if (i+1<argc) { datapath.append(argv[++i]); } else { show_usage( ); return EXIT_FAILURE; }
+    } else if (arg == "--vcf") {
+      if (i+1<argc) { datapath.append(argv[++i]); vcf = true; } else { show_usage( ); return EXIT_FAILURE; }
     } else if (arg == "--nthreads") {
       if (i+1<argc) { nthreads = atoi(argv[++i]); } else { show_usage( ); return EXIT_FAILURE; }
+    } else if (arg == "--memory") {
+      if (i+1<argc) { memoryMB = atol(argv[++i]); } else { show_usage( ); return EXIT_FAILURE; }
+    } else if (arg == "--binary") {
+      binary = true;
+    } else if (arg == "--gemm") {
+      gemm = true;
     }
   }
   ////////////////////////////////////////////////////////////////////////////////
@@ -41,9 +57,17 @@ int main(int argc, char * argv[])
 	    << "          = zbar_m (the average genotype at m) otherwise" << std::endl
 	    << std::endl;
    
-  Data data(bfilepath,nthreads);
-  data.getsize();
-  data.bed2diffs_v2();
+  Data data(datapath,nthreads,binary,memoryMB);
+  if (vcf) {
+    data.read_vcf();
+  } else {
+    data.getsize();
+  }
+  if (gemm) {
+    data.bed2diffs_v2_gemm();
+  } else {
+    data.bed2diffs_v2();
+  }
    
   return EXIT_SUCCESS;
 }
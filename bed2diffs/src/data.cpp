@@ -1,12 +1,33 @@
 
 #include "data.hpp"
 
-Data::Data(std::string datapath,int nthreads)
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+Data::Data(std::string datapath,int nthreads,bool binary,size_t memoryMB)
 {
   nSites = 0;
   nIndiv = 0;
   this->datapath = datapath;
   this->nthreads = nthreads;
+  this->binary = binary;
+  this->memoryBudget = memoryMB << 20;
+  this->bedData = NULL;
+  this->bedSize = 0;
+  this->vcfFile = NULL;
+  this->vcfReader = NULL;
+}
+
+Data::~Data( ) { 
+  if (bedData) { munmap( (void *)bedData, bedSize ); }
+  if (vcfFile) { delete vcfReader; gzclose( vcfFile ); }
+}
+
+void Data::getsize( )
+{
+  struct pio_file_t plink_file;
   if( pio_open( &plink_file, datapath.c_str() ) != PIO_OK )
     {
       std::cerr << "[Data::getsize] Error opening plink files " << datapath << ".[bed/bim/fam] "
@@ -27,190 +48,843 @@ Data::Data(std::string datapath,int nthreads)
       std::cerr << "[Data::getsize] bed2diffs requires plink files [bed/bim/fam] in SNP-major mode" << std::endl;
       exit(1);
     }
+  nIndiv = pio_num_samples( &plink_file );
+  nSites = pio_num_loci( &plink_file );
+  for (size_t i = 0 ; i < nIndiv ; i++ ) {
+    struct pio_sample_t *sample = pio_get_sample( &plink_file, i );
+    sampleIds.push_back(std::string(sample->fid) + " " + sample->iid);
+  }
+  pio_close( &plink_file );
+  std::cout << "Detected plink dataset " << datapath << ".[bed/bim/fam] "
+	    << "with " << nIndiv << " samples and " << nSites << " SNPs" << std::endl;
+  map_bed( );
 }
 
-Data::~Data( ) { 
-  pio_close( &plink_file );
+/*
+  Map the bed file into memory, so that the genotypes can be read directly in their packed form,
+  with 2 bits per genotype and the SNPs stored one after the other (in SNP-major mode).
+  libplinkio is still used to read the samples and the SNPs from the fam and bim files.
+*/
+void Data::map_bed( )
+{
+  std::string bedfile = datapath + ".bed";
+  bedRowBytes = (nIndiv + 3) / 4;
+  bedRow = 0;
+  int fd = open( bedfile.c_str(), O_RDONLY );
+  struct stat st;
+  if (fd < 0 || fstat( fd, &st ) != 0)
+    {
+      std::cerr << "[Data::map_bed] Error opening " << bedfile << std::endl;
+      exit(1);
+    }
+  bedSize = st.st_size;
+  if (bedSize != 3 + nSites*bedRowBytes)
+    {
+      std::cerr << "[Data::map_bed] " << bedfile << " does not have the expected size for "
+		<< nIndiv << " samples and " << nSites << " SNPs" << std::endl;
+      exit(1);
+    }
+  void *data = mmap( NULL, bedSize, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if (data == MAP_FAILED)
+    {
+      std::cerr << "[Data::map_bed] Error mapping " << bedfile << " into memory" << std::endl;
+      exit(1);
+    }
+  // The genotypes are read from beginning to end, once per pass
+  madvise( data, bedSize, MADV_SEQUENTIAL );
+  bedData = (const unsigned char *) data;
 }
 
-void Data::getsize( )
+/*
+  Read the genotypes from a VCF file, plain or compressed with gzip or bgzip, instead of plink files.
+  Only the GT field is used, and the sites with more than two alleles are skipped. The genotypes are
+  streamed from the file one site at a time, packed as in a bed file with 2 bits per genotype, and
+  then processed as if read from one; the file is read again for each pass over the SNPs.
+  A haploid genotype counts as homozygous, as in plink. The output files are named after the VCF file,
+  without the .vcf or .vcf.gz extension, and each sample is listed by its id twice in datapath.order.
+*/
+void Data::read_vcf( )
 {
-  nIndiv = pio_num_samples( &plink_file );
-  nSites = pio_num_loci( &plink_file );
-  std::cout << "Detected plink dataset " << datapath << ".[bed/bim/fam] "
-	    << "with " << nIndiv << " samples and " << nSites << " SNPs" << std::endl;
+  vcffile = datapath;
+  const char *extensions[] = { ".vcf.gz", ".vcf.bgz", ".vcf" };
+  for (int e = 0 ; e < 3 ; e++ ) {
+    size_t len = strlen(extensions[e]);
+    if (datapath.size() > len && datapath.compare(datapath.size() - len, len, extensions[e]) == 0) {
+      datapath.erase(datapath.size() - len);
+      break;
+    }
+  }
+  // The header line lists the samples after the first 9 columns
+  char *line = open_vcf( );
+  size_t column = 0;
+  for (char *p = line, *q = line ; ; q++ ) {
+    if (*q != '\t' && *q != '\0') { continue; }
+    if (column++ >= 9) { std::string id(p, q - p); sampleIds.push_back(id + " " + id); }
+    if (*q == '\0') { break; }
+    p = q + 1;
+  }
+  nIndiv = sampleIds.size();
+  bedRowBytes = (nIndiv + 3) / 4;
+  bedRow = 0;
+  if (!nIndiv)
+    {
+      std::cerr << "[Data::read_vcf] " << vcffile << " does not have any samples" << std::endl;
+      exit(1);
+    }
+  vcfRow.resize(bedRowBytes);
+  // The number of SNPs is only known after the first pass over the file
+  std::cout << "Detected VCF file " << vcffile << " with " << nIndiv << " samples" << std::endl;
+}
+
+// Open the VCF file and skip the meta-information lines; returns the header line
+char *Data::open_vcf( )
+{
+  vcfFile = gzopen( vcffile.c_str(), "rb" );
+  if (!vcfFile)
+    {
+      std::cerr << "[Data::open_vcf] Error opening " << vcffile << std::endl;
+      exit(1);
+    }
+  vcfReader = new LineReader(vcfFile);
+  vcfSkipped = 0;
+  size_t length = 0;
+  char *line = NULL;
+  while ((line = vcfReader->next(length)) && !strncmp(line, "##", 2)) { }
+  if (!line || strncmp(line, "#CHROM", 6))
+    {
+      std::cerr << "[Data::open_vcf] " << vcffile << " does not have a #CHROM header line" << std::endl;
+      exit(1);
+    }
+  return(line);
+}
+
+// The next biallelic site in the VCF file, packed as a row of a bed file, or NULL after the last site
+const unsigned char *Data::next_vcf_row( )
+{
+  size_t length = 0;
+  char *line = NULL;
+  while ((line = vcfReader->next(length))) {
+    if (!length) { continue; }
+    // Skip CHROM, POS, ID and REF, then check that there is a single ALT allele
+    char *p = line;
+    for (int c = 0 ; c < 4 && p ; c++ ) { p = strchr(p, '\t'); if (p) { p++; } }
+    char *format = p;
+    for (int c = 0 ; c < 4 && format ; c++ ) { format = strchr(format, '\t'); if (format) { format++; } }
+    if (!format)
+      {
+	std::cerr << "[Data::next_vcf_row] " << vcffile << " has a site with fewer than 9 columns" << std::endl;
+	exit(1);
+      }
+    char *alt = p;
+    while (*p != '\t' && *p != ',') { p++; }
+    if (*p == ',' || *alt == '\t') { vcfSkipped++; continue; }
+    // Find the position of GT among the FORMAT keys
+    int gtIndex = 0;
+    for (p = format ; strncmp(p, "GT", 2) || (p[2] != ':' && p[2] != '\t' && p[2] != '\0') ; gtIndex++ ) {
+      p += strcspn(p, ":\t");
+      if (*p != ':') { break; }
+      p++;
+    }
+    if (*p != 'G') { vcfSkipped++; continue; }
+    p = format + strcspn(format, "\t");
+
+    unsigned char *row = &vcfRow[0];
+    memset(row, 0, bedRowBytes);
+    for (size_t i = 0 ; i < nIndiv ; i++ ) {
+      if (*p != '\t')
+	{
+	  std::cerr << "[Data::next_vcf_row] " << vcffile << " has a site with fewer than "
+		    << nIndiv << " samples" << std::endl;
+	  exit(1);
+	}
+      p++;
+      for (int k = 0 ; k < gtIndex ; k++ ) {
+	while (*p != ':' && *p != '\t' && *p) { p++; }
+	if (*p == ':') { p++; }
+      }
+      // Each allele is '.' (missing), 0 (reference) or a positive number (alternative)
+      int alleles = 0, nAlleles = 0;
+      bool missing = false;
+      while (true) {
+	if (*p == '.') {
+	  missing = true; p++;
+	} else if (*p >= '0' && *p <= '9') {
+	  bool alternative = false;
+	  while (*p >= '0' && *p <= '9') { alternative |= (*p != '0'); p++; }
+	  alleles += alternative;
+	} else {
+	  missing = true;
+	}
+	nAlleles++;
+	if (*p != '/' && *p != '|') { break; }
+	p++;
+      }
+      if (nAlleles == 1) { alleles *= 2; }
+      // In the bed file, 00 and 11 are the two homozygotes, 10 is a heterozygote and 01 is missing
+      unsigned code = missing || nAlleles > 2 ? 1 : alleles == 0 ? 0 : alleles == 1 ? 2 : 3;
+      row[i/4] |= code << (2*(i%4));
+      while (*p != '\t' && *p) { p++; }
+    }
+    bedRow++;
+    return(row);
+  }
+  if (!nSites) {
+    nSites = bedRow;
+    std::cout << "Read " << nSites << " SNPs from the VCF file";
+    if (vcfSkipped) { std::cout << " (skipped " << vcfSkipped << " sites that are not biallelic or have no GT field)"; }
+    std::cout << std::endl;
+  }
+  return(NULL);
+}
+
+// Start the next pass over the SNPs from the first one
+void Data::rewind_genotypes( )
+{
+  bedRow = 0;
+  if (vcfFile) {
+    delete vcfReader;
+    gzclose( vcfFile );
+    open_vcf( );
+  }
+}
+
+/*
+  The lines of a text file, plain or compressed with gzip, read in large chunks.
+  The buffer grows to hold the longest line, which can be long in a VCF file with many samples.
+*/
+LineReader::LineReader(gzFile file)
+{
+  this->file = file;
+  begin = end = 0;
+  eof = false;
+  buffer.resize(1 << 20);
+  gzbuffer( file, 1 << 20 );
+}
+
+// Return the next line, without the end of line, or NULL after the last line
+char *LineReader::next(size_t &length)
+{
+  while (true) {
+    char *first = &buffer[begin];
+    char *newline = (char *) memchr(first, '\n', end - begin);
+    if (newline || (eof && begin < end)) {
+      char *last = newline ? newline : &buffer[end];
+      begin = newline ? newline - &buffer[0] + 1 : end;
+      if (last > first && last[-1] == '\r') { last--; }
+      *last = '\0';
+      length = last - first;
+      return(first);
+    }
+    if (eof) { return(NULL); }
+    // Move the partial line to the front of the buffer and read the next chunk after it
+    memmove(&buffer[0], first, end - begin);
+    end -= begin;
+    begin = 0;
+    if (buffer.size() - end < (1 << 19)) { buffer.resize(2*buffer.size()); }
+    int n = gzread( file, &buffer[end], buffer.size() - end - 1 );
+    if (n < 0)
+      {
+	std::cerr << "[LineReader::next] Error reading the input file" << std::endl;
+	exit(1);
+      }
+    if (n == 0) { eof = true; }
+    end += n;
+  }
 }
 
+// The next SNP in the bed file, as a row of packed genotypes, or NULL after the last SNP
+const unsigned char *Data::next_bed_row( )
+{
+  if (vcfFile) { return(next_vcf_row( )); }
+  if (bedRow == nSites) { return(NULL); }
+  return(bedData + 3 + bedRowBytes*bedRow++);
+}
+
+// In the bed file, 00 and 11 are the two homozygotes, 10 is a heterozygote and 01 is a missing genotype
+static const snp_t bed_codes[4] = { 0, PLINK_NA, 1, 2 };
+
+static inline snp_t bed_genotype(const unsigned char *row, size_t i)
+{
+  return(bed_codes[(row[i/4] >> (2*(i%4))) & 3]);
+}
+
+/*
+  Sum the squared differences (zi - zj)^2 between two samples, and count the SNPs where both are called,
+  across a block of packed genotypes. With both samples called, the difference is 1 if exactly one sample
+  is heterozygous, and 4 if neither is heterozygous and only one is homozygous for allele 2.
+*/
+#ifdef __AVX2__
+static inline __m256i popcount256(__m256i v)
+{
+  // Look up the popcount of each 4-bit nibble, then add up the bytes in each 64-bit lane
+  const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+					  0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, nibble));
+  __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+  return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+static inline uint64_t sum256(__m256i v)
+{
+  return (uint64_t)_mm256_extract_epi64(v, 0) + (uint64_t)_mm256_extract_epi64(v, 1)
+    + (uint64_t)_mm256_extract_epi64(v, 2) + (uint64_t)_mm256_extract_epi64(v, 3);
+}
+
+static inline void packed_diffs(const uint64_t *gi, const uint64_t *gj, uint64_t &sumDiffs, uint64_t &numCalled)
+{
+  __m256i ones = _mm256_setzero_si256(), fours = _mm256_setzero_si256(), called = _mm256_setzero_si256();
+  for (size_t w = 0 ; w < GENO_WORDS ; w += 4 ) {
+    __m256i nm = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(gi + w)),
+				  _mm256_loadu_si256((const __m256i *)(gj + w)));
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(gi + GENO_WORDS + w));
+    __m256i hj = _mm256_loadu_si256((const __m256i *)(gj + GENO_WORDS + w));
+    __m256i ai = _mm256_loadu_si256((const __m256i *)(gi + 2*GENO_WORDS + w));
+    __m256i aj = _mm256_loadu_si256((const __m256i *)(gj + 2*GENO_WORDS + w));
+    called = _mm256_add_epi64(called, popcount256(nm));
+    ones = _mm256_add_epi64(ones, popcount256(_mm256_and_si256(nm, _mm256_xor_si256(hi, hj))));
+    fours = _mm256_add_epi64(fours, popcount256(_mm256_andnot_si256(_mm256_or_si256(hi, hj),
+								   _mm256_and_si256(nm, _mm256_xor_si256(ai, aj)))));
+  }
+  sumDiffs = sum256(ones) + 4 * sum256(fours);
+  numCalled = sum256(called);
+}
+#else
+static inline void packed_diffs(const uint64_t *gi, const uint64_t *gj, uint64_t &sumDiffs, uint64_t &numCalled)
+{
+  uint64_t ones = 0, fours = 0, called = 0;
+  for (size_t w = 0 ; w < GENO_WORDS ; w++ ) {
+    uint64_t nm = gi[w] & gj[w];
+    uint64_t hi = gi[GENO_WORDS + w], hj = gj[GENO_WORDS + w];
+    uint64_t ai = gi[2*GENO_WORDS + w], aj = gj[2*GENO_WORDS + w];
+    called += __builtin_popcountll(nm);
+    ones += __builtin_popcountll(nm & (hi ^ hj));
+    fours += __builtin_popcountll(nm & ~(hi | hj) & (ai ^ aj));
+  }
+  sumDiffs = ones + 4 * fours;
+  numCalled = called;
+}
+#endif
+
 void Data::bed2diffs_v1()
 {
-  std::string diffsfile = datapath + ".diffs";
-  std::string countfile = datapath + ".count";
-  std::string orderfile = datapath + ".order";
-  std::ofstream outdiffs(diffsfile.c_str(), std::ios::out);
-  std::ofstream outcount(countfile.c_str(), std::ios::out);
-  std::ofstream outorder(orderfile.c_str(), std::ios::out);
+  size_t nPairs = nIndiv*(nIndiv-1)/2;
+  size_t nSitesProcessed = 0;
+  GenoCache cache;
+
+  // The thread buffers take 16 bytes per pair, and the differences and counts another 16 bytes
+  if (!memoryBudget || 32*nPairs <= memoryBudget) {
+    double *diffs = (double *) malloc( sizeof(double)*nPairs );
+    double *count = (double *) malloc( sizeof(double)*nPairs );
+    nSitesProcessed = sum_packed_diffs(pair_tiles(0, nIndiv, true), 0, diffs, count, cache);
+    std::cout << "Computed average pairwise differences across " << nSitesProcessed << " SNPs" << std::endl;
+    write_diffs(diffs, count, nSitesProcessed, true);
+    report_times( );
+    free( diffs );
+    free( count );
+    return;
+  }
+
+  // Otherwise compute the differences for a band of rows at a time, with one pass over the SNPs per band.
+  // The packed genotypes are much smaller than the pairs, so keep them in memory after the first pass
+  // if they take at most half of the budget. The number of SNPs in a VCF file is not known until the end
+  // of the first pass, so then half of the budget is set aside for the genotypes in case they fit.
+  cache.maxBytes = memoryBudget / 2;
+  cache.enabled = vcfFile || packed_bytes() <= cache.maxBytes;
+  size_t cacheBytes = vcfFile ? cache.maxBytes : cache.enabled ? packed_bytes() : 0;
+  size_t bandRows = band_rows(memoryBudget - cacheBytes, 32);
+  std::cout << "Compute the differences for " << bandRows << " samples at a time"
+	    << (cache.enabled ? ", with the packed genotypes kept in memory" : "")
+	    << (vcfFile ? " if they fit" : "") << std::endl;
+
+  write_order( );
+  DiffsWriter writer(datapath, nIndiv, binary, true);
+  double *diffs = (double *) malloc( sizeof(double)*bandRows*nIndiv );
+  double *count = (double *) malloc( sizeof(double)*bandRows*nIndiv );
 
-  outdiffs.precision(12);
-  outdiffs.setf(std::ios::fixed,std::ios::floatfield);
-  
+  for (size_t r0 = 0 ; r0 < nIndiv ; r0 += bandRows ) {
+    size_t r1 = std::min(r0 + bandRows, nIndiv);
+    nSitesProcessed = sum_packed_diffs(pair_tiles(r0, r1, false), r0, diffs, count, cache);
+    if (cache.enabled) { cache.filled = true; } else { rewind_genotypes( ); }
+    write_rows(writer, r0, r1, [&](size_t i, double *rowDiffs, double *rowCount) {
+	memcpy(rowDiffs, diffs + (i-r0)*nIndiv, sizeof(double)*nIndiv);
+	memcpy(rowCount, count + (i-r0)*nIndiv, sizeof(double)*nIndiv); });
+  }
+
+  writer.close(nSitesProcessed);
+  std::cout << "Computed average pairwise differences across " << nSitesProcessed << " SNPs" << std::endl;
+  report_times( );
+
+  free( diffs );
+  free( count );
+}
+
+void Data::bed2diffs_v2()
+{
   size_t nPairs = nIndiv*(nIndiv-1)/2;
   size_t nSitesProcessed = 0;
 
-  // Read the genotypes in serial, compute the differences in parallel
-  snp_t *snps = (snp_t *) malloc( sizeof(snp_t)*nIndiv );
-  size_t *a = (size_t *) malloc( sizeof(size_t)*nPairs );
-  size_t *b = (size_t *) malloc( sizeof(size_t)*nPairs );
-  double *diffs = (double *) malloc( sizeof(double)*nPairs );
-  double *count = (double *) malloc( sizeof(double)*nPairs );
+  // The thread buffers take 8 bytes per pair, and the differences and counts another 16 bytes
+  if (!memoryBudget || 24*nPairs <= memoryBudget) {
+    double *diffs = (double *) malloc( sizeof(double)*nPairs );
+    double *count = (double *) malloc( sizeof(double)*nPairs );
+    nSitesProcessed = sum_imputed_diffs(pair_tiles(0, nIndiv, true), 0, diffs, count);
+    std::cout << "Computed average pairwise differences across " << nSitesProcessed << " SNPs" << std::endl;
+    write_diffs(diffs, count, nSitesProcessed, false);
+    report_times( );
+    free( diffs );
+    free( count );
+    return;
+  }
 
-  for (size_t i = 0 ; i < (nIndiv-1) ; i++ ) {
-    for (size_t j = i+1 ; j < nIndiv ; j++ ) {
-      size_t ij = Index(i, j);
-      diffs[ij] = 0.0;
-      count[ij] = 0.0;
-      a[ij] = i;
-      b[ij] = j;
-    }
+  // Otherwise compute the differences for a band of rows at a time, with one pass over the SNPs per band
+  size_t bandRows = band_rows(memoryBudget, 24);
+  std::cout << "Compute the differences for " << bandRows << " samples at a time" << std::endl;
+
+  write_order( );
+  DiffsWriter writer(datapath, nIndiv, binary, false);
+  double *diffs = (double *) malloc( sizeof(double)*bandRows*nIndiv );
+  double *count = (double *) malloc( sizeof(double)*bandRows*nIndiv );
+
+  for (size_t r0 = 0 ; r0 < nIndiv ; r0 += bandRows ) {
+    size_t r1 = std::min(r0 + bandRows, nIndiv);
+    nSitesProcessed = sum_imputed_diffs(pair_tiles(r0, r1, false), r0, diffs, count);
+    rewind_genotypes( );
+    write_rows(writer, r0, r1, [&](size_t i, double *rowDiffs, double *rowCount) {
+	memcpy(rowDiffs, diffs + (i-r0)*nIndiv, sizeof(double)*nIndiv);
+	memcpy(rowCount, count + (i-r0)*nIndiv, sizeof(double)*nIndiv); });
   }
 
-  while (pio_next_row( &plink_file, snps ) == PIO_OK) {
+  writer.close(nSitesProcessed);
+  std::cout << "Computed average pairwise differences across " << nSitesProcessed << " SNPs" << std::endl;
+  report_times( );
 
-    nSitesProcessed++;
-    
-    #pragma omp parallel for
-    for (size_t ij = 0 ; ij < nPairs ; ij++ ) {
-      size_t zi = snps[a[ij]];
-      size_t zj = snps[b[ij]];
-      if ((zi != PLINK_NA) && (zj != PLINK_NA)) {
-	diffs[ij] += (zi - zj) * (zi - zj);
-	count[ij] += 1.0;
+  free( diffs );
+  free( count );
+}
+
+/*
+  Sum the squared differences, and count the SNPs where both samples are called, for the pairs in the tiles.
+  The genotypes are read in blocks of SNPs, packed into bitplanes, and compared with bitwise operations and
+  popcounts, 64 SNPs at a time. If the tiles cover the upper triangle, the results are stored in the order
+  given by Index(i,j); otherwise diffs and count hold the rows r0, r0+1, ... of the full matrix.
+  Returns the number of SNPs.
+*/
+size_t Data::sum_packed_diffs(const std::vector<PairTile> &tiles, size_t r0, double *diffs, double *count, GenoCache &cache)
+{
+  size_t nSitesProcessed = 0, nSitesBlock = 0, block = 0;
+  const uint64_t *geno = NULL;
+  BlockReader<uint64_t> reader(nIndiv*GENO_PLANES*GENO_WORDS, times, [&](uint64_t *buffer) {
+      return next_packed_block( buffer, cache, block++ ); });
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  double idle = times.computeIdle;
+
+  #pragma omp parallel
+  {
+    // Each thread works on the same tiles throughout and sums the differences in its own buffers
+    size_t thread = omp_get_thread_num( ), nThreads = omp_get_num_threads( );
+    size_t nTiles = (tiles.size() + nThreads - 1 - thread) / nThreads;
+    std::vector<uint64_t> tileDiffs(nTiles*TILE_SAMPLES*TILE_SAMPLES, 0);
+    std::vector<uint64_t> tileCount(nTiles*TILE_SAMPLES*TILE_SAMPLES, 0);
+
+    while (true) {
+
+      #pragma omp single
+      {
+	// All threads are done with the previous block, so its buffer can be filled again
+	if (geno) { reader.release( ); }
+	geno = reader.next( nSitesBlock );
+	nSitesProcessed += nSitesBlock;
+      }
+      if (nSitesBlock == 0) { break; }
+
+      for (size_t t = thread, k = 0 ; t < tiles.size() ; t += nThreads, k++ ) {
+	const PairTile &tile = tiles[t];
+	uint64_t *sums = &tileDiffs[k*TILE_SAMPLES*TILE_SAMPLES];
+	uint64_t *cnts = &tileCount[k*TILE_SAMPLES*TILE_SAMPLES];
+	for (size_t i = tile.i0 ; i < tile.i1 ; i++ ) {
+	  const uint64_t *gi = geno + i*GENO_PLANES*GENO_WORDS;
+	  size_t ij = (i - tile.i0)*TILE_SAMPLES;
+	  for (size_t j = tile.upper ? std::max(tile.j0, i+1) : tile.j0 ; j < tile.j1 ; j++ ) {
+	    if (j == i) { continue; }
+	    uint64_t sumDiffs, numCalled;
+	    packed_diffs(gi, geno + j*GENO_PLANES*GENO_WORDS, sumDiffs, numCalled);
+	    sums[ij + j - tile.j0] += sumDiffs;
+	    cnts[ij + j - tile.j0] += numCalled;
+	  }
+	}
+      }
+
+      // Wait until all threads are done with this block before moving on to the next one
+      #pragma omp barrier
+    }
+
+    for (size_t t = thread, k = 0 ; t < tiles.size() ; t += nThreads, k++ ) {
+      const PairTile &tile = tiles[t];
+      for (size_t i = tile.i0 ; i < tile.i1 ; i++ ) {
+	for (size_t j = tile.upper ? std::max(tile.j0, i+1) : tile.j0 ; j < tile.j1 ; j++ ) {
+	  if (j == i) { continue; }
+	  size_t tij = k*TILE_SAMPLES*TILE_SAMPLES + (i - tile.i0)*TILE_SAMPLES + j - tile.j0;
+	  size_t ij = tile.upper ? Index(i, j) : (i - r0)*nIndiv + j;
+	  diffs[ij] = tileDiffs[tij];
+	  count[ij] = tileCount[tij];
+	}
       }
     }
   }
 
-  std::cout << "Computed average pairwise differences across " << nSitesProcessed << " SNPs" << std::endl;
+  times.compute += seconds_since(start) - (times.computeIdle - idle);
+  return(nSitesProcessed);
+}
 
-  if (!outdiffs.is_open() || !outorder.is_open())
-    {
-      std::cerr << "[Data::bed2diffs] Error writing output files" << std::endl;
-      exit(1);
-    }   
+/*
+  Sum the squared differences for the pairs in the tiles, with the missing genotypes imputed as the
+  average genotype at each SNP. The genotypes are read in blocks of SNPs, and each pair adds up the SNPs
+  in the order they are read. The results are stored as in sum_packed_diffs. Returns the number of SNPs.
+*/
+size_t Data::sum_imputed_diffs(const std::vector<PairTile> &tiles, size_t r0, double *diffs, double *count)
+{
+  size_t nSitesProcessed = 0, nSitesBlock = 0;
+  const double *geno = NULL;
+  BlockReader<double> reader(nIndiv*TILE_SNPS, times, [&](double *buffer) {
+      return read_imputed_block( buffer ); });
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  double idle = times.computeIdle;
 
-  for (size_t i = 0 ; i < nIndiv ; i++ ) {
+  #pragma omp parallel
+  {
+    // Each thread works on the same tiles throughout and sums the differences in its own buffer
+    size_t thread = omp_get_thread_num( ), nThreads = omp_get_num_threads( );
+    size_t nTiles = (tiles.size() + nThreads - 1 - thread) / nThreads;
+    std::vector<double> tileDiffs(nTiles*TILE_SAMPLES*TILE_SAMPLES, 0.0);
 
-    struct pio_sample_t *sample = pio_get_sample( &plink_file, i );
-    outorder << sample->fid << " " << sample->iid << std::endl;
+    while (true) {
 
-    for (size_t j = 0 ; j < nIndiv ; j++ ) {
-      if (i == j) {
-	outdiffs << " " << 0;
-      } else {
-	size_t ij = Index(i, j);
-	outdiffs << " " << diffs[ij] / count[ij];
-	outcount << " " << count[ij];
+      #pragma omp single
+      {
+	// All threads are done with the previous block, so its buffer can be filled again
+	if (geno) { reader.release( ); }
+	geno = reader.next( nSitesBlock );
+	nSitesProcessed += nSitesBlock;
+      }
+      if (nSitesBlock == 0) { break; }
+
+      for (size_t t = thread, k = 0 ; t < tiles.size() ; t += nThreads, k++ ) {
+	const PairTile &tile = tiles[t];
+	double *sums = &tileDiffs[k*TILE_SAMPLES*TILE_SAMPLES];
+	for (size_t i = tile.i0 ; i < tile.i1 ; i++ ) {
+	  const double *zi = geno + i*TILE_SNPS;
+	  size_t ij = (i - tile.i0)*TILE_SAMPLES;
+	  for (size_t j = tile.upper ? std::max(tile.j0, i+1) : tile.j0 ; j < tile.j1 ; j++ ) {
+	    if (j == i) { continue; }
+	    const double *zj = geno + j*TILE_SNPS;
+	    double sum = sums[ij + j - tile.j0];
+	    for (size_t m = 0 ; m < nSitesBlock ; m++ ) {
+	      sum += (zi[m] - zj[m]) * (zi[m] - zj[m]);
+	    }
+	    sums[ij + j - tile.j0] = sum;
+	  }
+	}
+      }
+
+      // Wait until all threads are done with this block before moving on to the next one
+      #pragma omp barrier
+    }
+
+    for (size_t t = thread, k = 0 ; t < tiles.size() ; t += nThreads, k++ ) {
+      const PairTile &tile = tiles[t];
+      for (size_t i = tile.i0 ; i < tile.i1 ; i++ ) {
+	for (size_t j = tile.upper ? std::max(tile.j0, i+1) : tile.j0 ; j < tile.j1 ; j++ ) {
+	  if (j == i) { continue; }
+	  size_t tij = k*TILE_SAMPLES*TILE_SAMPLES + (i - tile.i0)*TILE_SAMPLES + j - tile.j0;
+	  size_t ij = tile.upper ? Index(i, j) : (i - r0)*nIndiv + j;
+	  diffs[ij] = tileDiffs[tij];
+	  count[ij] = nSitesProcessed;
+	}
       }
     }
-    outdiffs << std::endl;
-    outcount << std::endl;
   }
-  
-  outdiffs.close( );
-  outcount.close( );
-  outorder.close( );
-  free( a );
-  free( b );
-  free( snps );
-  free( diffs );
-  free( count );
+
+  times.compute += seconds_since(start) - (times.computeIdle - idle);
+  return(nSitesProcessed);
 }
 
-void Data::bed2diffs_v2()
+/*
+  Version 2 computed as a matrix product: with the missing genotypes imputed and each SNP centered
+  at its observed mean (which does not change the differences), the sum of squared differences
+  is Dij = Gii + Gjj - 2Gij where G = ZZ' and Z is the nIndiv-by-nSites genotype matrix.
+  G is accumulated over blocks of GEMM_SNPS SNPs with Eigen's cache-blocked matrix product.
+*/
+void Data::bed2diffs_v2_gemm()
 {
-  std::string diffsfile = datapath + ".diffs";
-  std::string orderfile = datapath + ".order";
-  std::ofstream outdiffs(diffsfile.c_str(), std::ios::out);
-  std::ofstream outorder(orderfile.c_str(), std::ios::out);
-
-  outdiffs.precision(12);
-  outdiffs.setf(std::ios::fixed,std::ios::floatfield);
-  
   size_t nPairs = nIndiv*(nIndiv-1)/2;
   size_t nSitesProcessed = 0;
 
-  // Read the genotypes in serial, compute the differences in parallel
-  snp_t *snps = (snp_t *) malloc( sizeof(snp_t)*nIndiv );
-  size_t *a = (size_t *) malloc( sizeof(size_t)*nPairs );
-  size_t *b = (size_t *) malloc( sizeof(size_t)*nPairs );
+  Eigen::MatrixXd G = Eigen::MatrixXd::Zero(nIndiv, nIndiv);
+
+  {
+    BlockReader<double> reader(nIndiv*GEMM_SNPS, times, [&](double *buffer) {
+	return read_centered_block( buffer ); });
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double idle = times.computeIdle;
+    size_t nSitesBlock;
+    const double *geno;
+    while ((geno = reader.next( nSitesBlock )), nSitesBlock > 0) {
+      Eigen::Map<const Eigen::MatrixXd> Z(geno, nIndiv, nSitesBlock);
+      nSitesProcessed += nSitesBlock;
+      G.noalias() += Z * Z.transpose();
+      reader.release( );
+    }
+    times.compute += seconds_since(start) - (times.computeIdle - idle);
+  }
+
+  std::cout << "Computed average pairwise differences across " << nSitesProcessed << " SNPs" << std::endl;
+
   double *diffs = (double *) malloc( sizeof(double)*nPairs );
   double *count = (double *) malloc( sizeof(double)*nPairs );
-
   for (size_t i = 0 ; i < (nIndiv-1) ; i++ ) {
-    for (size_t j = i+1 ; j < nIndiv ; j++ ) {
-      size_t ij = Index(i, j);
-      diffs[ij] = 0.0;
-      count[ij] = 0.0;
-      a[ij] = i;
-      b[ij] = j;
+    size_t ij = Index(i, i+1);
+    for (size_t j = i+1 ; j < nIndiv ; j++, ij++ ) {
+      diffs[ij] = G(i,i) + G(j,j) - 2.0 * G(i,j);
+      count[ij] = nSitesProcessed;
     }
   }
 
-  while (pio_next_row( &plink_file, snps ) == PIO_OK) {
+  write_diffs(diffs, count, nSitesProcessed, false);
+  report_times( );
 
-    nSitesProcessed++;
+  free( diffs );
+  free( count );
+}
 
-    // Compute the observed genotype mean
-    int sumGeno = 0, nObsrvd = 0;
-    for (size_t i = 0 ; i < nIndiv ; i++ ) {
-      size_t zi = snps[i];
-      if (zi != PLINK_NA) { 
-	sumGeno += zi; nObsrvd += 1;
-      }
+void Data::write_order( )
+{
+  std::string orderfile = datapath + ".order";
+  std::ofstream outorder(orderfile.c_str(), std::ios::out);
+  if (!outorder.is_open())
+    {
+      std::cerr << "[Data::bed2diffs] Error writing output files" << std::endl;
+      exit(1);
+    }   
+  for (size_t i = 0 ; i < nIndiv ; i++ ) {
+    outorder << sampleIds[i] << std::endl;
+  }
+  outorder.close( );
+}
+
+/*
+  Write the average differences diffs/count, stored in the order given by Index(i,j),
+  the sample order to datapath.order and, optionally, the counts to datapath.count
+*/
+void Data::write_diffs(const double *diffs, const double *count, size_t nSitesProcessed, bool writeCount)
+{
+  write_order( );
+  DiffsWriter writer(datapath, nIndiv, binary, writeCount);
+  write_rows(writer, 0, nIndiv, [&](size_t i, double *rowDiffs, double *rowCount) {
+      for (size_t j = 0 ; j < nIndiv ; j++ ) {
+	if (i == j) { continue; }
+	size_t ij = Index(i, j);
+	rowDiffs[j] = diffs[ij];
+	rowCount[j] = count[ij];
+      } });
+  writer.close(nSitesProcessed);
+}
+
+/*
+  Write rows r0 to r1-1 of the matrix, where row(i, rowDiffs, rowCount) fills in the sums and the counts
+  for the pairs (i,j). Formatting the numbers takes much longer than writing them, so the threads format
+  FORMAT_ROWS consecutive rows each into their own buffers, which are then written out in order.
+*/
+void Data::write_rows(DiffsWriter &writer, size_t r0, size_t r1,
+		      const std::function<void(size_t,double*,double*)> &row)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<std::string> textDiffs, textCount;
+
+  #pragma omp parallel
+  {
+    // Each thread formats its own rows of every band into its own buffers
+    size_t thread = omp_get_thread_num( ), nThreads = omp_get_num_threads( );
+    std::vector<double> rowDiffs(nIndiv, 0.0), rowCount(nIndiv, 0.0);
+    #pragma omp single
+    {
+      textDiffs.resize(nThreads);
+      textCount.resize(nThreads);
     }
-    double aveGeno = sumGeno / (double)nObsrvd;
 
-    #pragma omp parallel for
-    for (size_t ij = 0 ; ij < nPairs ; ij++ ) {
-      // If a genotype missing, impute it with the average genotype (which is a double, not an int)
-      double zi = (double)snps[a[ij]];
-      double zj = (double)snps[b[ij]];
-      if (zi == PLINK_NA) { zi = aveGeno; }
-      if (zj == PLINK_NA) { zj = aveGeno; }
-      diffs[ij] += (zi - zj) * (zi - zj);
-      count[ij] += 1.0;
+    for (size_t b0 = r0 ; b0 < r1 ; b0 += nThreads*FORMAT_ROWS ) {
+      size_t i0 = std::min(b0 + thread*FORMAT_ROWS, r1);
+      size_t i1 = std::min(i0 + FORMAT_ROWS, r1);
+      textDiffs[thread].clear( );
+      textCount[thread].clear( );
+      for (size_t i = i0 ; i < i1 ; i++ ) {
+	row(i, &rowDiffs[0], &rowCount[0]);
+	writer.format_row(i, &rowDiffs[0], &rowCount[0], textDiffs[thread], textCount[thread]);
+      }
+
+      // Wait until all threads have formatted their rows of this band before moving on to the next one
+      #pragma omp barrier
+      #pragma omp single
+      {
+	for (size_t t = 0 ; t < nThreads ; t++ ) {
+	  writer.write(textDiffs[t], textCount[t]);
+	}
+      }
     }
   }
 
-  std::cout << "Computed average pairwise differences across " << nSitesProcessed << " SNPs" << std::endl;
+  times.write += seconds_since(start);
+}
 
-  if (!outdiffs.is_open() || !outorder.is_open())
+/*
+  Report the time spent reading the genotypes, computing the differences and writing the output.
+  If the computation waits for the genotypes, reading is the bottleneck, and vice versa.
+*/
+void Data::report_times( )
+{
+  std::ios::fmtflags flags = std::cout.flags( );
+  std::streamsize precision = std::cout.precision( );
+  std::cout << std::fixed << std::setprecision(2)
+	    << "Reading the genotypes took " << times.read << " seconds"
+	    << " (plus " << times.readIdle << " seconds waiting for the computation)" << std::endl
+	    << "Computing the differences took " << times.compute << " seconds"
+	    << " (plus " << times.computeIdle << " seconds waiting for the genotypes)" << std::endl
+	    << "Writing the output took " << times.write << " seconds" << std::endl;
+  std::cout.flags(flags);
+  std::cout.precision(precision);
+}
+
+static inline void append_digits(std::string &text, uint64_t x, int minDigits)
+{
+  char digits[24];
+  int n = 0;
+  do { digits[n++] = '0' + x % 10; x /= 10; } while (x || n < minDigits);
+  while (n) { text += digits[--n]; }
+}
+
+/*
+  Append x with 12 decimals, exactly as std::ios::fixed with precision(12) (that is, printf("%.12f")) would.
+  x = m / 2^shift with m an integer of at most 53 bits, so x * 10^12 can be computed exactly in 128 bits
+  and then rounded to the nearest integer, with ties to even. Negative numbers, numbers from 2^20 up
+  and non-finite numbers are left to snprintf.
+*/
+static void append_fixed12(std::string &text, double x)
+{
+  if (std::signbit(x) || !(x < 1048576.0)) {
+    char buffer[512];
+    int n = snprintf(buffer, sizeof(buffer), "%.12f", x);
+    text.append(buffer, n);
+    return;
+  }
+  const uint64_t scale = 1000000000000ULL;
+  int e;
+  double f = frexp(x, &e);
+  uint64_t m = (uint64_t) ldexp(f, 53);
+  int shift = 53 - e;
+  uint64_t q = 0;
+  // m * 10^12 < 2^93, so it rounds to 0 if shift > 94
+  if (shift <= 94) {
+    unsigned __int128 scaled = (unsigned __int128)m * scale;
+    unsigned __int128 half = (unsigned __int128)1 << (shift - 1);
+    unsigned __int128 rem = scaled & ((half << 1) - 1);
+    q = (uint64_t)(scaled >> shift);
+    if (rem > half || (rem == half && (q & 1))) { q++; }
+  }
+  append_digits(text, q / scale, 1);
+  text += '.';
+  append_digits(text, q % scale, 12);
+}
+
+// Append a count as std::ostream with the default format would: the counts are integers, so this is
+// just the digits unless the count takes more than 6 significant digits
+static void append_count(std::string &text, double x)
+{
+  if (x >= 0.0 && x < 1e6 && x == floor(x)) {
+    append_digits(text, (uint64_t)x, 1);
+  } else {
+    char buffer[64];
+    int n = snprintf(buffer, sizeof(buffer), "%g", x);
+    text.append(buffer, n);
+  }
+}
+
+/*
+  In binary format, datapath.diffs.bin holds the 8-byte tag "EEMSDIF1", the number of samples and the number
+  of SNPs as 64-bit integers, then the nIndiv*(nIndiv-1)/2 entries of the upper triangle, row by row,
+  as 64-bit doubles. This is the order of the pairs given by Index(i,j), so the diagonal is not stored.
+*/
+DiffsWriter::DiffsWriter(const std::string &datapath, size_t nIndiv, bool binary, bool writeCount)
+{
+  this->nIndiv = nIndiv;
+  this->binary = binary;
+  this->writeCount = writeCount;
+  if (binary) {
+    std::string diffsfile = datapath + ".diffs.bin";
+    outdiffs.open(diffsfile.c_str(), std::ios::out | std::ios::binary);
+  } else {
+    std::string diffsfile = datapath + ".diffs";
+    outdiffs.open(diffsfile.c_str(), std::ios::out);
+  }
+  if (writeCount) {
+    std::string countfile = datapath + ".count";
+    outcount.open(countfile.c_str(), std::ios::out);
+  }
+  if (!outdiffs.is_open())
     {
       std::cerr << "[Data::bed2diffs] Error writing output files" << std::endl;
       exit(1);
     }   
 
-  for (size_t i = 0 ; i < nIndiv ; i++ ) {
-
-    struct pio_sample_t *sample = pio_get_sample( &plink_file, i );
-    outorder << sample->fid << " " << sample->iid << std::endl;
+  if (binary) {
+    // The number of SNPs is filled in when the file is closed
+    int64_t header[2] = { (int64_t)nIndiv, 0 };
+    outdiffs.write("EEMSDIF1", 8);
+    outdiffs.write((const char *)header, sizeof(header));
+  }
+}
 
-    for (size_t j = 0 ; j < nIndiv ; j++ ) {
-      if (i == j) {
-	outdiffs << " " << 0;
-      } else {
-	size_t ij = Index(i, j);
-	outdiffs << " " << diffs[ij] / count[ij];
-      }
+/*
+  Append row i of the matrix to rowDiffs, and to rowCount if the counts are written,
+  in the output format; diffs[j] and count[j] are the sum and the count for the pair (i,j)
+*/
+void DiffsWriter::format_row(size_t i, const double *diffs, const double *count,
+			     std::string &rowDiffs, std::string &rowCount) const
+{
+  if (binary) {
+    for (size_t j = i+1 ; j < nIndiv ; j++ ) {
+      double dij = diffs[j] / count[j];
+      rowDiffs.append((const char *)&dij, sizeof(double));
     }
-    outdiffs << std::endl;
   }
-  
+  if (binary && !writeCount) { return; }
+  for (size_t j = 0 ; j < nIndiv ; j++ ) {
+    if (i == j) {
+      if (!binary) { rowDiffs += " 0"; }
+    } else {
+      if (!binary) { rowDiffs += ' '; append_fixed12(rowDiffs, diffs[j] / count[j]); }
+      if (writeCount) { rowCount += ' '; append_count(rowCount, count[j]); }
+    }
+  }
+  if (!binary) { rowDiffs += '\n'; }
+  if (writeCount) { rowCount += '\n'; }
+}
+
+void DiffsWriter::write(const std::string &rowDiffs, const std::string &rowCount)
+{
+  outdiffs.write(rowDiffs.data(), rowDiffs.size());
+  if (writeCount) { outcount.write(rowCount.data(), rowCount.size()); }
+}
+
+void DiffsWriter::close(size_t nSitesProcessed)
+{
+  if (binary) {
+    int64_t nSites = nSitesProcessed;
+    outdiffs.seekp(8 + sizeof(int64_t));
+    outdiffs.write((const char *)&nSites, sizeof(nSites));
+  }
   outdiffs.close( );
-  outorder.close( );
-  free( a );
-  free( b );
-  free( snps );
-  free( diffs );
-  free( count );
+  outcount.close( );
 }
 
 size_t Data::Index(size_t i, size_t j) {
@@ -232,3 +906,146 @@ size_t Data::Index(size_t i, size_t j) {
   }
   return(ij);
 }
+
+/*
+  Read up to GENO_WORDS*64 SNPs and pack them into bitplanes: for sample i, geno[i*GENO_PLANES*GENO_WORDS]
+  starts the GENO_WORDS words of called SNPs, followed by the heterozygous and the homozygous-for-allele-2 SNPs.
+  The bits after the last SNP are 0, so a partial block does not contribute to the differences.
+  Returns the number of SNPs read.
+*/
+size_t Data::read_packed_block(uint64_t *geno)
+{
+  memset(geno, 0, sizeof(uint64_t)*nIndiv*GENO_PLANES*GENO_WORDS);
+  size_t k = 0;
+  for ( ; k < 64*GENO_WORDS ; k++ ) {
+    const unsigned char *row = next_bed_row( );
+    if (!row) { break; }
+    size_t w = k / 64;
+    uint64_t bit = (uint64_t)1 << (k % 64);
+    // Missing genotypes (code 01) are left out of all three planes
+    for (size_t i = 0 ; i < nIndiv ; i++ ) {
+      unsigned code = (row[i/4] >> (2*(i%4))) & 3;
+      if (code == 1) { continue; }
+      uint64_t *gi = geno + i*GENO_PLANES*GENO_WORDS;
+      gi[w] |= bit;
+      if (code == 2) { gi[GENO_WORDS + w] |= bit; }
+      if (code == 3) { gi[2*GENO_WORDS + w] |= bit; }
+    }
+  }
+  return(k);
+}
+
+/*
+  Read the next block of packed genotypes, from the plink file or from the cache if it has been filled
+  during an earlier pass over the SNPs. Returns the number of SNPs in the block.
+*/
+size_t Data::next_packed_block(uint64_t *geno, GenoCache &cache, size_t block)
+{
+  size_t blockWords = nIndiv*GENO_PLANES*GENO_WORDS;
+  if (cache.filled) {
+    if (block >= cache.blockSites.size()) { return(0); }
+    memcpy(geno, &cache.geno[block*blockWords], sizeof(uint64_t)*blockWords);
+    return(cache.blockSites[block]);
+  }
+  size_t nSitesBlock = read_packed_block( geno );
+  if (cache.enabled && nSitesBlock > 0) {
+    if (sizeof(uint64_t)*(cache.geno.size() + blockWords) > cache.maxBytes) {
+      std::cout << "The packed genotypes do not fit in memory, so the SNPs will be read again for each band" << std::endl;
+      cache.enabled = false;
+      std::vector<uint64_t>().swap(cache.geno);
+      cache.blockSites.clear();
+      return(nSitesBlock);
+    }
+    cache.geno.insert(cache.geno.end(), geno, geno + blockWords);
+    cache.blockSites.push_back(nSitesBlock);
+  }
+  return(nSitesBlock);
+}
+
+/*
+  Read up to GEMM_SNPS SNPs into the columns of the nIndiv-by-GEMM_SNPS matrix Z (stored in geno),
+  with the missing genotypes imputed as the observed mean and then every genotype centered at the mean.
+  Returns the number of SNPs read.
+*/
+size_t Data::read_centered_block(double *geno)
+{
+  Eigen::Map<Eigen::MatrixXd> Z(geno, nIndiv, GEMM_SNPS);
+  size_t k = 0;
+  for ( ; k < GEMM_SNPS ; k++ ) {
+    const unsigned char *row = next_bed_row( );
+    if (!row) { break; }
+    // Compute the observed genotype mean
+    int sumGeno = 0, nObsrvd = 0;
+    for (size_t i = 0 ; i < nIndiv ; i++ ) {
+      size_t zi = bed_genotype(row, i);
+      if (zi != PLINK_NA) { 
+	sumGeno += zi; nObsrvd += 1;
+      }
+    }
+    double aveGeno = sumGeno / (double)nObsrvd;
+    for (size_t i = 0 ; i < nIndiv ; i++ ) {
+      snp_t zi = bed_genotype(row, i);
+      Z(i,k) = ((zi == PLINK_NA) ? aveGeno : (double)zi) - aveGeno;
+    }
+  }
+  return(k);
+}
+
+/*
+  Split the pairs (i,j) with r0 <= i < r1 into tiles of TILE_SAMPLES x TILE_SAMPLES samples, small enough
+  that the genotypes of both sets of samples stay in cache. With upper = true, only the pairs with i < j.
+*/
+std::vector<PairTile> Data::pair_tiles(size_t r0, size_t r1, bool upper)
+{
+  std::vector<PairTile> tiles;
+  for (size_t i0 = r0 ; i0 < r1 ; i0 += TILE_SAMPLES ) {
+    for (size_t j0 = upper ? i0 : 0 ; j0 < nIndiv ; j0 += TILE_SAMPLES ) {
+      PairTile tile = { i0, std::min(i0 + TILE_SAMPLES, r1), j0, std::min(j0 + TILE_SAMPLES, nIndiv), upper };
+      tiles.push_back(tile);
+    }
+  }
+  return(tiles);
+}
+
+// The number of rows of the matrix to compute at a time within the given memory,
+// a multiple of TILE_SAMPLES, if each pair takes bytesPerPair bytes
+size_t Data::band_rows(size_t bytes, size_t bytesPerPair)
+{
+  size_t rows = bytes / (bytesPerPair*nIndiv);
+  rows -= rows % TILE_SAMPLES;
+  return(std::max(rows, (size_t)TILE_SAMPLES));
+}
+
+// The memory needed to keep all SNPs in packed form
+size_t Data::packed_bytes( )
+{
+  size_t nBlocks = (nSites + 64*GENO_WORDS - 1) / (64*GENO_WORDS);
+  return(nBlocks*nIndiv*GENO_PLANES*GENO_WORDS*sizeof(uint64_t));
+}
+
+/*
+  Read up to TILE_SNPS SNPs, with the missing genotypes imputed as the observed mean:
+  for sample i, geno[i*TILE_SNPS] starts the genotypes in the block. Returns the number of SNPs read.
+*/
+size_t Data::read_imputed_block(double *geno)
+{
+  size_t k = 0;
+  for ( ; k < TILE_SNPS ; k++ ) {
+    const unsigned char *row = next_bed_row( );
+    if (!row) { break; }
+    // Compute the observed genotype mean
+    int sumGeno = 0, nObsrvd = 0;
+    for (size_t i = 0 ; i < nIndiv ; i++ ) {
+      size_t zi = bed_genotype(row, i);
+      if (zi != PLINK_NA) { 
+	sumGeno += zi; nObsrvd += 1;
+      }
+    }
+    double aveGeno = sumGeno / (double)nObsrvd;
+    for (size_t i = 0 ; i < nIndiv ; i++ ) {
+      snp_t zi = bed_genotype(row, i);
+      geno[i*TILE_SNPS + k] = (zi == PLINK_NA) ? aveGeno : (double)zi;
+    }
+  }
+  return(k);
+}
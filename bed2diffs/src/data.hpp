@@ -4,28 +4,241 @@
 #include <iomanip>
 #include <iostream>
 #include <algorithm>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
+// GCC reports spurious maybe-uninitialized warnings in the AVX-512 intrinsics used by Eigen
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include <Eigen/Dense>
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
 #include <plinkio/plinkio.h>
+#include <zlib.h>
+#include <omp.h>
 #define PLINK_NA 3
 
+// bed2diffs_v1 packs the genotypes of GENO_WORDS*64 SNPs at a time into GENO_PLANES bitplanes
+// per sample: the SNPs where the sample is called, heterozygous, and homozygous for allele 2
+#define GENO_WORDS 16
+#define GENO_PLANES 3
+
+// The pairs of samples are processed in tiles of TILE_SAMPLES x TILE_SAMPLES,
+// and bed2diffs_v2 reads TILE_SNPS SNPs at a time
+#define TILE_SAMPLES 64
+#define TILE_SNPS 256
+
+// bed2diffs_v2_gemm accumulates the genotype cross-product over blocks of GEMM_SNPS SNPs
+#define GEMM_SNPS 1024
+
+// The number of blocks of SNPs that can be read ahead of the computation
+#define READ_BUFFERS 3
+
+// When writing the output, each thread formats FORMAT_ROWS rows of the matrix at a time
+#define FORMAT_ROWS 16
+
+
+// The pairs (i,j) with i0 <= i < i1 and j0 <= j < j1, and i != j
+// (and i < j if the tile is part of the upper triangle)
+struct PairTile {
+  size_t i0, i1, j0, j1;
+  bool upper;
+};
+
+// The packed genotypes, block by block, kept in memory between passes over the SNPs
+// (the cache is dropped if the genotypes turn out to take more than maxBytes)
+struct GenoCache {
+  bool enabled, filled;
+  size_t maxBytes;
+  std::vector<uint64_t> geno;
+  std::vector<size_t> blockSites;
+  GenoCache( ) : enabled(false), filled(false), maxBytes(0) { }
+};
+
+// The time spent in each stage, in seconds, and the time each stage waits for the other
+struct StageTimes {
+  double read, compute, write, readIdle, computeIdle;
+  StageTimes( ) : read(0), compute(0), write(0), readIdle(0), computeIdle(0) { }
+};
+
+// Reads blocks of SNPs on a background thread into a ring of READ_BUFFERS buffers,
+// so that reading and decoding the genotypes overlaps with computing the differences.
+// read(buffer) fills a buffer with the next block and returns the number of SNPs, 0 at the end.
+template <typename T>
+class BlockReader {
+public:
+
+  BlockReader(size_t blockSize,StageTimes &times,std::function<size_t(T*)> read) :
+    times(times), read(read), produced(0), consumed(0), released(0), stop(false)
+  {
+    for (int b = 0 ; b < READ_BUFFERS ; b++ ) { buffers[b].resize(blockSize); }
+    thread = std::thread(&BlockReader::run, this);
+  }
+  ~BlockReader( ) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    changed.notify_all();
+    thread.join();
+  }
+  // Wait for the next block; the buffer stays valid until release() is called
+  const T *next(size_t &nSitesBlock) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex);
+    while (consumed == produced) { changed.wait(lock); }
+    times.computeIdle += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int b = consumed++ % READ_BUFFERS;
+    nSitesBlock = nSites[b];
+    return(&buffers[b][0]);
+  }
+  void release( ) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      released++;
+    }
+    changed.notify_all();
+  }
+
+private:
+
+  void run( ) {
+    while (true) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      size_t b;
+      {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (produced - released == READ_BUFFERS && !stop) { changed.wait(lock); }
+	if (stop) { return; }
+	b = produced % READ_BUFFERS;
+      }
+      std::chrono::steady_clock::time_point ready = std::chrono::steady_clock::now();
+      size_t n = read(&buffers[b][0]);
+      times.readIdle += std::chrono::duration<double>(ready - start).count();
+      times.read += std::chrono::duration<double>(std::chrono::steady_clock::now() - ready).count();
+      {
+	std::lock_guard<std::mutex> lock(mutex);
+	nSites[b] = n;
+	produced++;
+      }
+      changed.notify_all();
+      if (n == 0) { return; }
+    }
+  }
+
+  StageTimes &times;
+  std::function<size_t(T*)> read;
+  std::vector<T> buffers[READ_BUFFERS];
+  size_t nSites[READ_BUFFERS];
+  size_t produced, consumed, released;
+  bool stop;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::thread thread;
+
+};
+
+// Reads the lines of a text file, plain or compressed with gzip
+class LineReader {
+public:
+
+  LineReader(gzFile file);
+
+  char *next(size_t &length);
+
+private:
+
+  gzFile file;
+  std::vector<char> buffer;
+  size_t begin, end;
+  bool eof;
+
+};
+
+// Writes the average differences one row of the matrix at a time,
+// to datapath.diffs (or datapath.diffs.bin) and optionally the counts to datapath.count
+class DiffsWriter {
+public:
+
+  DiffsWriter(const std::string &datapath,size_t nIndiv,bool binary,bool writeCount);
+
+  void format_row(size_t i,const double *diffs,const double *count,std::string &rowDiffs,std::string &rowCount) const;
+  void write(const std::string &rowDiffs,const std::string &rowCount);
+  void close(size_t nSitesProcessed);
+
+private:
+
+  size_t nIndiv;
+  bool binary, writeCount;
+  std::ofstream outdiffs, outcount;
+
+};
 
 class Data {
 public:
       
   size_t nIndiv, nSites;
-  struct pio_file_t plink_file;
   std::string datapath;
   int nthreads;
+  bool binary;
+  size_t memoryBudget;
+  StageTimes times;
+  std::vector<std::string> sampleIds;
+  const unsigned char *bedData;
+  size_t bedSize, bedRowBytes, bedRow;
+  std::string vcffile;
+  gzFile vcfFile;
+  LineReader *vcfReader;
+  std::vector<unsigned char> vcfRow;
+  size_t vcfSkipped;
       
-  Data(std::string datapath,int nthreads);
+  Data(std::string datapath,int nthreads,bool binary,size_t memoryMB);
   ~Data();
 
   void getsize();
+  void read_vcf();
   void bed2diffs_v1();
   void bed2diffs_v2();
+  void bed2diffs_v2_gemm();
 
 protected:
   
   size_t Index(size_t i,size_t j);
+  std::vector<PairTile> pair_tiles(size_t r0,size_t r1,bool upper);
+  size_t band_rows(size_t bytes,size_t bytesPerPair);
+  size_t packed_bytes();
+  size_t sum_packed_diffs(const std::vector<PairTile> &tiles,size_t r0,double *diffs,double *count,GenoCache &cache);
+  size_t sum_imputed_diffs(const std::vector<PairTile> &tiles,size_t r0,double *diffs,double *count);
+  void map_bed();
+  const unsigned char *next_bed_row();
+  char *open_vcf();
+  const unsigned char *next_vcf_row();
+  void rewind_genotypes();
+  size_t read_packed_block(uint64_t *geno);
+  size_t next_packed_block(uint64_t *geno,GenoCache &cache,size_t block);
+  size_t read_imputed_block(double *geno);
+  size_t read_centered_block(double *geno);
+  void write_order();
+  void report_times();
+  void write_rows(DiffsWriter &writer,size_t r0,size_t r1,const std::function<void(size_t,double*,double*)> &row);
+  void write_diffs(const double *diffs,const double *count,size_t nSitesProcessed,bool writeCount);
 
 };
@@ -401,6 +401,11 @@ void EEMS::calc_between(const VectorXi &mColors, const VectorXd &mEffcts, const
 double EEMS::EEMS_wishpdfln(const MatrixXd &B, const VectorXd &W, const VectorXd &sigma2, VectorXd &triDeltaQD) const {
   VectorXd ldetDinvQ = VectorXd::Zero(p);
   if (triDeltaQD.size() != p) { triDeltaQD.resize(p); }
+  // The loci are independent given B and W, so evaluate them in parallel.
+  // The number of observed demes varies between loci, so the loci are handed out dynamically.
+  // Each locus writes only its own entries, which are summed in order below,
+  // so the log likelihood does not depend on the number of threads
+#pragma omp parallel for schedule(dynamic)
   for ( int i = 0 ; i < p ; i++ ) {
     VectorXd Wi = slice(W,ovec[i]);
     VectorXd Wiinv = pow(Wi.array(),-1.0);
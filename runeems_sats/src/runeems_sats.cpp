@@ -1,6 +1,9 @@
 
 #include "eems.hpp"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <boost/config.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/parsers.hpp>
@@ -87,6 +90,8 @@ int main(int argc, char** argv)
        "Success probability for the number of Voronoi tiles ~ negbinom(negBiSize, negBiProb)")
       ("negBiSize", po::value<int>(&params.negBiSize)->default_value(10),
        "Size for the number of Voronoi tiles ~ negbinom(negBiSize, negBiProb)")
+      ("nthreads", po::value<int>(&params.nthreads)->default_value(1),
+       "Number of threads used to compute the likelihood, in parallel over the microsatellite loci.")
       ;
     
     po::options_description cmdline_options;
@@ -112,6 +117,12 @@ int main(int argc, char** argv)
 
     params.seed = seed;
     params.check_input_arguments();
+    // The loci are split between threads; Eigen's own products stay single-threaded,
+    // as their blocking (and so the rounding) would otherwise depend on the number of threads
+#ifdef _OPENMP
+    omp_set_num_threads(params.nthreads);
+#endif
+    Eigen::setNbThreads(1);
     
     EEMS eems(params);
     MCMC mcmc(params);
@@ -30,6 +30,7 @@ Params::Params( ) {
   sigmaScale_2 = 1.0;
   negBiProb = 0.67;
   negBiSize = 10;
+  nthreads = 1;
   mEffctHalfInterval = 2.0;
   qEffctHalfInterval = 0.1;
   mrateMuHalfInterval = 2.4771; // log10(300)
@@ -70,6 +71,7 @@ void Params::check_input_arguments() {
   check_condition(negBiSize > 0, "Check that negBiSize > 0");
   check_condition(negBiProb > 0.0 && negBiProb < 1.0,
 		  "Check that negBiProb in (0,1)");
+  check_condition(nthreads > 0, "Check that nthreads > 0");
   check_condition(dist_metric.compare("euclidean") || dist_metric.compare("greatcirc"),
 		  "Check that 'distance' is either 'euclidean' or 'greatcirc'");
   /////////////////////////////////////////////////////
@@ -125,6 +127,7 @@ ostream& operator<<(ostream& out, const Params& params) {
       << "            numBurnIter = " << params.numBurnIter << endl
       << "            numThinIter = " << params.numThinIter << endl
       << "              negBiSize = " << params.negBiSize << endl
+      << "               nthreads = " << params.nthreads << endl
       << fixed << setprecision(6)
       << "              negBiProb = " << params.negBiProb << endl
       << "             qVoronoiPr = " << params.qVoronoiPr << endl
@@ -319,31 +322,106 @@ MatrixXd expected_dissimilarities(const MatrixXd &J, const MatrixXd &M, const Ve
   Delta.diagonal() -= Jw;
   return Delta;
 }
-// Read a matrix, with unknown dimensions, from a text file
-// Return an empty matrix (0 rows, 0 columns) if there is an error
+/*
+  Parse a decimal number (an optional sign, digits with an optional decimal point and an optional
+  exponent) that starts at pos, directly from the mapped file and independently of the locale.
+  Up to 19 significant digits are collected into an integer; if it and the power of ten are both
+  exactly representable as doubles, a single multiplication or division gives the correctly rounded
+  result, as strtod would. The other (rare) numbers are converted by a stream in the "C" locale.
+  Returns false if there is no number at pos. Afterwards pos points just after the number
+ */
+static bool parse_number(const char *&pos, const char *end, double &number) {
+  static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+				    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+  const char *start = pos;
+  bool negative = false;
+  if (pos < end && (*pos == '-' || *pos == '+')) { negative = (*pos == '-'); pos++; }
+  const char *unsigned_start = pos;
+  uint64_t mantissa = 0;
+  int digits = 0, exponent = 0;
+  bool exact = true, seen = false;
+  for (bool point = false ; pos < end ; pos++) {
+    if (*pos == '.' && !point) { point = true; continue; }
+    if (*pos < '0' || *pos > '9') { break; }
+    seen = true;
+    if (mantissa || *pos != '0') { digits++; }
+    if (digits <= 19) {
+      mantissa = 10 * mantissa + (*pos - '0');
+      if (point) { exponent--; }
+    } else {
+      // Further digits are dropped, so the fast path below does not apply
+      if (*pos != '0') { exact = false; }
+      if (!point) { exponent++; }
+    }
+  }
+  if (!seen) { pos = start; return false; }
+  if (pos < end && (*pos == 'e' || *pos == 'E')) {
+    pos++;
+    bool negexp = false;
+    if (pos < end && (*pos == '-' || *pos == '+')) { negexp = (*pos == '-'); pos++; }
+    if (pos == end || *pos < '0' || *pos > '9') { pos = start; return false; }
+    int e = 0;
+    for ( ; pos < end && *pos >= '0' && *pos <= '9' ; pos++) { if (e < 100000) { e = 10 * e + (*pos - '0'); } }
+    exponent += negexp ? -e : e;
+  }
+  if (exact && mantissa < (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+    number = (double)mantissa;
+    number = (exponent < 0) ? number / powers[-exponent] : number * powers[exponent];
+  } else {
+    istringstream in(string(unsigned_start, pos));
+    in.imbue(locale::classic());
+    in >> number;
+    if (in.fail()) { pos = start; return false; }
+  }
+  if (negative) { number = -number; }
+  return true;
+}
+// Parse one line of whitespace-separated numbers, starting at pos, into row.
+// Returns false if the line contains anything other than numbers. Afterwards pos points to the next line
+static bool parse_line(const char *&pos, const char *end, vector<double> &row) {
+  row.clear();
+  const char *eol = static_cast<const char*>(memchr(pos, '\n', end - pos));
+  if (!eol) { eol = end; }
+  bool valid = true;
+  while (pos < eol) {
+    while (pos < eol && isspace((unsigned char)*pos)) { pos++; }
+    if (pos == eol) { break; }
+    double number;
+    if (!parse_number(pos, eol, number) || (pos < eol && !isspace((unsigned char)*pos))) { valid = false; break; }
+    row.push_back(number);
+  }
+  pos = (eol < end) ? eol + 1 : end;
+  return valid;
+}
+/*
+  Read a matrix of numbers, with unknown dimensions, one row per line. The file is mapped into memory
+  and read once: the first line determines the number of columns and the number of lines determines
+  the number of rows, so the matrix is allocated only once. Returns an empty matrix (0 rows, 0 columns)
+  if the file cannot be opened or if the rows are not all of the same length.
+ */
 MatrixXd readMatrixXd(const string &filename) {
-  ifstream instrm(filename.c_str(), ios::in);
-  if (!instrm.is_open( )) { return (MatrixXd::Zero(0,0)); }
-  string line; getline(instrm,line);
-  boost::algorithm::trim(line);
+  boost::iostreams::mapped_file_source file;
+  try {
+    file.open(filename);
+  } catch (exception &e) {
+    return (MatrixXd::Zero(0,0));
+  }
+  if (!file.is_open() || !file.size()) { return (MatrixXd::Zero(0,0)); }
+  const char *pos = file.data(), *end = file.data() + file.size();
+  int rows = count(pos, end, '\n');
+  if (end[-1] != '\n') { rows++; }
+  vector<double> row;
   // Split the first line into numbers
-  VectorXd row = split(line);
   // This tells us the number of columns
+  if (!parse_line(pos,end,row) || row.empty()) { return (MatrixXd::Zero(0,0)); }
   int cols = row.size();
-  if (!cols) { return (MatrixXd::Zero(0,0)); }
-  MatrixXd mat(1,cols); mat.row(0) = row;
-  while (getline(instrm,line)) {
-    boost::algorithm::trim(line);
-    row = split(line);
-    if (row.size()==cols) {
-      // Resize the matrix to add each row (done once at the start)
-      insertRow(mat,row);
-    } else {
-      return (MatrixXd::Zero(0,0));
-    }
+  MatrixXd mat(rows,cols);
+  mat.row(0) = RowVectorXd::Map(&row[0],cols);
+  for ( int i = 1 ; i < rows ; i++ ) {
+    if (!parse_line(pos,end,row) || (int)row.size() != cols) { return (MatrixXd::Zero(0,0)); }
+    mat.row(i) = RowVectorXd::Map(&row[0],cols);
   }
-  instrm.close();
-  return mat;
+  return (mat);
 }
 // If there are two draws and the first has two tiles and the second -- three tiles,
 // then sizes = c(2,3) and array = c(m_{1t_1},m_{1t_2},m_{2t_1},m_{2t_2},m_{2t_3})
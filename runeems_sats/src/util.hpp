@@ -1,6 +1,9 @@
 #pragma once
 
 #include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
 #include <vector>
 #include <limits>
 #include <iomanip>
@@ -20,6 +23,7 @@ using namespace Eigen;
 #include <boost/math/distributions/normal.hpp>
 #include <boost/numeric/conversion/bounds.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 
 #ifndef UTIL_H
 #define UTIL_H
@@ -55,6 +59,7 @@ public:
   double qVoronoiPr, negBiProb;
   int numMCMCIter, numBurnIter, numThinIter;
   int nDemes, nIndiv, nSites, negBiSize;
+  int nthreads;
 };
 
 VectorXd split(const string &line);
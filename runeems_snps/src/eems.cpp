@@ -3,7 +3,27 @@
 
 extern string dist_metric;
 
-EEMS::EEMS(const Params &params) {
+EEMSData::EEMSData(const Params &params) {
+  mcmcpath = params.mcmcpath;
+  habitat.generate_outer(params.datapath, params.mcmcpath);
+  graph.generate_grid(params.datapath, params.gridpath, params.mcmcpath,
+		      habitat, params.nDemes, params.nIndiv);
+  o = graph.get_num_obsrv_demes();
+  d = graph.get_num_total_demes();
+  n = params.nIndiv;
+  p = params.nSites;
+  initialize_diffs(params);
+}
+EEMSData::~EEMSData( ) { }
+EEMS::EEMS(const Params &params) : EEMS(params, boost::shared_ptr<const EEMSData>(new EEMSData(params))) { }
+EEMS::EEMS(const Params &params, const boost::shared_ptr<const EEMSData> &data) :
+  data(data), graph(data->graph), habitat(data->habitat),
+  o(data->o), d(data->d), n(data->n), p(data->p),
+  Diffs(data->Diffs), L(data->L), J(data->J), cvec(data->cvec), cinv(data->cinv), cmin1(data->cmin1),
+  JtDobsJ(data->JtDobsJ), JtDobsJCinv(data->JtDobsJCinv),
+  ldLLt(data->ldLLt), ldDiQ(data->ldDiQ), ldLDLt(data->ldLDLt),
+  n_2(data->n_2), logn(data->logn), nmin1(data->nmin1)
+{
   this->params = params;
 
   ofstream out; string outfile = params.mcmcpath + "/eemsrun.txt";
@@ -13,14 +33,18 @@ EEMS::EEMS(const Params &params) {
   out.close();
   
   draw.initialize(params.seed);
-  habitat.generate_outer(params.datapath, params.mcmcpath);
-  graph.generate_grid(params.datapath, params.gridpath, params.mcmcpath,
-		      habitat, params.nDemes, params.nIndiv);
-  o = graph.get_num_obsrv_demes();
-  d = graph.get_num_total_demes();
-  n = params.nIndiv;
-  p = params.nSites;
-  initialize_diffs();
+  invTemperature = 1.0;
+  // The habitat and the grid are written once, when the data is loaded,
+  // so copy them to the output directory of this chain
+  if (params.mcmcpath != data->mcmcpath) {
+    const char *files[] = { "outer.txt", "ipmap.txt", "demes.txt", "edges.txt" };
+    for ( int i = 0 ; i < 4 ; i++ ) {
+      boost::filesystem::path from(data->mcmcpath + "/" + files[i]), to(params.mcmcpath + "/" + files[i]);
+      boost::filesystem::copy_file(from, to, boost::filesystem::copy_option::overwrite_if_exists);
+    }
+  }
+  JtDhatJ = MatrixXd::Zero(o,o);
+  initialize_sparse();
   if (params.diploid) {
     Binvconst = 1.0; Wconst = 2.0;
   } else {
@@ -53,7 +77,7 @@ void EEMS::rnorm_effects(const double HalfInterval, const double rateS2, VectorX
     Effcts(i) = draw.rtrnorm(0.0,rateS2,HalfInterval);
   }
 }
-void EEMS::initialize_diffs( ) {
+void EEMSData::initialize_diffs(const Params &params) {
   cout << "[Diffs::initialize]" << endl;
   n_2 = (double)n/2.0; nmin1 = n-1; logn = log(n);
   J = MatrixXd::Zero(n,o);
@@ -65,20 +89,39 @@ void EEMS::initialize_diffs( ) {
   }
   cinv = pow(cvec.array(),-1.0).matrix();  // cinv is the vector of inverse counts
   cmin1 = cvec; cmin1.array() -= 1;        // cmin1 is the vector of counts - 1
-  Diffs = readMatrixXd(params.datapath + ".diffs");
+  // Prefer the binary dissimilarity matrix, which is faster to load, if bed2diffs wrote one,
+  // unless the text matrix is newer (then the binary file is left over from an earlier run)
+  string diffsfile = params.datapath + ".diffs", packedfile = params.datapath + ".diffs.bin";
+  if (boost::filesystem::exists(packedfile) &&
+      (!boost::filesystem::exists(diffsfile) ||
+       boost::filesystem::last_write_time(packedfile) >= boost::filesystem::last_write_time(diffsfile))) {
+    Diffs = readPackedDiffs(packedfile, params.nSites);
+  } else {
+    cout << "  Read the dissimilarities from " << diffsfile << endl;
+    Diffs = readMatrixXd(diffsfile);
+  }
   check_condition(Diffs.rows() == n && Diffs.cols() == n,
 		  "Check that the dissimilarity matrix is a square nIndiv-by-nIndiv matrix.");
   check_condition(isdistmat(Diffs),
 		  "The dissimilarity matrix is not a full-rank distance matrix.");
   L = MatrixXd::Constant(nmin1,n,-1.0);
   L.topRightCorner(nmin1,nmin1).setIdentity();
-  JtDhatJ = MatrixXd::Zero(o,o);
   JtDobsJ = J.transpose()*Diffs*J;
+  JtDobsJCinv = JtDobsJ*cinv.asDiagonal();
   ldLLt = logdet(L*L.transpose());
   ldLDLt = logdet(-L*Diffs*L.transpose());
   ldDiQ = ldLLt - ldLDLt;
   cout << "[Diffs::initialize] Done." << endl << endl;
 }
+// The sparsity pattern of the Laplacian is determined by the graph alone,
+// so compute the fill-reducing ordering and the symbolic factorization only once
+void EEMS::initialize_sparse( ) {
+  if (o==d) { return; }
+  MatrixXd Loo; SpMat Luo, Luu;
+  calc_laplacian(VectorXi::Zero(d),VectorXd::Zero(1),0.0,Loo,Luo,Luu);
+  LuuLLT.analyzePattern(Luu);
+  nowLuuLLT.analyzePattern(Luu);
+}
 void EEMS::initialize_state( ) {
   cout << "[EEMS::initialize_state]" << endl;
   nowdf = n;
@@ -147,27 +190,15 @@ void EEMS::load_final_state( ) {
   graph.index_closest_to_deme(nowqSeeds,nowqColors);
   cout << "[EEMS::load_final_state] Done." << endl << endl;
 }
-bool EEMS::start_eems(const MCMC &mcmc) {
+bool EEMS::start_eems( ) {
   // The deviation of move proposals is scaled by the habitat range
   params.mSeedsProposalS2x = params.mSeedsProposalS2 * habitat.get_xspan();
   params.mSeedsProposalS2y = params.mSeedsProposalS2 * habitat.get_yspan();
   params.qSeedsProposalS2x = params.qSeedsProposalS2 * habitat.get_xspan();
   params.qSeedsProposalS2y = params.qSeedsProposalS2 * habitat.get_yspan();
-  // MCMC draws are stored in memory, rather than saved to disk,
-  // so it is important to thin
-  int niters = mcmc.num_iters_to_save();
-  mcmcmhyper = MatrixXd::Zero(niters,2);
-  mcmcqhyper = MatrixXd::Zero(niters,2);
-  mcmcthetas = MatrixXd::Zero(niters,2);
-  mcmcpilogl = MatrixXd::Zero(niters,2);
-  mcmcmtiles = VectorXd::Zero(niters);
-  mcmcqtiles = VectorXd::Zero(niters);
-  mcmcmRates.clear();
-  mcmcqRates.clear();
-  mcmcxCoord.clear();
-  mcmcyCoord.clear();
-  mcmcwCoord.clear();
-  mcmczCoord.clear();
+  // MCMC draws are written to disk as they are saved, but it is still important to thin
+  niters = 0;
+  writer.reset(new TraceWriter(params.mcmcpath, !params.outputFormat.compare("binary")));
   eval_prior();
   eval_likelihood();
   cout << "Input parameters: " << endl << params << endl
@@ -255,9 +286,11 @@ double EEMS::eval_likelihood( ) {
   // For every pair of demes -- what is the effective resistance distance B(a,b)?
   // Binv is the inverse of B
   calc_between(nowmColors,nowmEffcts,nowmrateMu,nowBinv);
-  double triDeltaQD, ll_atfixdf;
+  calc_inverse_between(nowBinv,nowB);
+  refactor_between();
+  refactor_within();
   // Compute the Wishart log likelihood
-  nowll = EEMS_wishpdfln(nowBinv,nowW,nowsigma2,nowdf,nowtriDeltaQD,nowll_atfixdf);
+  nowll = EEMS_wishpdfln(nowB,nowW,nowsigma2,nowdf,nowtriDeltaQD,nowll_atfixdf);
   return (nowll);
 }
 void EEMS::calc_within(const VectorXi &qColors, const VectorXd &qEffcts, VectorXd &W) const {
@@ -271,15 +304,19 @@ void EEMS::calc_within(const VectorXi &qColors, const VectorXd &qEffcts, VectorX
   // The constant is slightly different for haploid and diploid species
   W *= Wconst;
 }
-void EEMS::calc_between(const VectorXi &mColors, const VectorXd &mEffcts, const double mrateMu, MatrixXd &Binv) const {
-  // d is the number of demes in the graph (observed or not)
-  if (Binv.rows()!=d||Binv.cols()!=d) { Binv.resize(d,d); }
-  // A sparse matrix of migration rates will be constructed on the fly
-  // First a triplet (a,b,m) is added for each edge (a,b)
-  // I have decided to construct the sparse matrix rather than update it
-  // because a single change to the migration Voronoi tessellation can
-  // change the migration rate of many edges simultaneously
-  vector<Tri> coefficients;
+/*
+  Construct the graph Laplacian, L = diag(M*1) - M, of the matrix of migration rates M,
+  split into blocks that correspond to the observed demes (indices 0 to o-1) and
+  the unobserved demes (indices o to d-1). Loo is dense because the number of observed demes
+  is usually small but Luu and Luo are sparse, with at most six off-diagonal entries per column
+  in the case of a triangular grid. The sparsity pattern of Luu and Luo depends only on the graph,
+  not on the migration rates, so the symbolic analysis of Luu can be done once.
+ */
+void EEMS::calc_laplacian(const VectorXi &mColors, const VectorXd &mEffcts, const double mrateMu,
+			  MatrixXd &Loo, SpMat &Luo, SpMat &Luu) const {
+  Loo = MatrixXd::Zero(o,o);
+  vector<Tri> uoCoefficients;
+  vector<Tri> uuCoefficients;
   int alpha, beta;
   // For every edge in the graph -- it does not matter whether demes are observed or not
   // as the resistance distance takes into consideration all paths between a and b
@@ -293,42 +330,139 @@ void EEMS::calc_between(const VectorXi &mColors, const VectorXd &mEffcts, const
     // Then on the original scale, m(alpha,beta) = (10^m_alpha + 10^m_beta)/2
     double m_ab = 0.5 * pow(10.0,log10m_alpha) + 0.5 * pow(10.0,log10m_beta);
     // The graph is undirected, so m(alpha->beta) = m(beta->alpha)
-    coefficients.push_back(Tri(alpha,beta,m_ab));
-    coefficients.push_back(Tri(beta,alpha,m_ab));
-  }
-  SpMat sparseM(d,d);
-  // Actually construct and fill in the sparse matrix
-  sparseM.setFromTriplets(coefficients.begin(),coefficients.end());
-  // Initialize a dense matrix from the sparse matrix
-  MatrixXd M = MatrixXd(sparseM);
+    if (alpha > beta) { swap(alpha,beta); }
+    if (beta < o) {              // Both demes are observed
+      Loo(alpha,alpha) += m_ab; Loo(beta,beta) += m_ab;
+      Loo(alpha,beta) -= m_ab; Loo(beta,alpha) -= m_ab;
+    } else if (alpha < o) {      // Deme alpha is observed, deme beta is not
+      Loo(alpha,alpha) += m_ab;
+      uuCoefficients.push_back(Tri(beta-o,beta-o,m_ab));
+      uoCoefficients.push_back(Tri(beta-o,alpha,-m_ab));
+    } else {                     // Neither deme is observed
+      uuCoefficients.push_back(Tri(alpha-o,alpha-o,m_ab));
+      uuCoefficients.push_back(Tri(beta-o,beta-o,m_ab));
+      uuCoefficients.push_back(Tri(alpha-o,beta-o,-m_ab));
+      uuCoefficients.push_back(Tri(beta-o,alpha-o,-m_ab));
+    }
+  }
+  // Actually construct and fill in the sparse matrices (duplicate triplets are summed up)
+  Luo.resize(d-o,o);
+  Luu.resize(d-o,d-o);
+  Luo.setFromTriplets(uoCoefficients.begin(),uoCoefficients.end());
+  Luu.setFromTriplets(uuCoefficients.begin(),uuCoefficients.end());
+}
+void EEMS::calc_between(const VectorXi &mColors, const VectorXd &mEffcts, const double mrateMu, MatrixXd &Binv) const {
+  // o is the number of observed demes, d is the number of demes in the graph (observed or not)
+  if (Binv.rows()!=o||Binv.cols()!=o) { Binv.resize(o,o); }
+  // I have decided to construct the sparse Laplacian rather than update it
+  // because a single change to the migration Voronoi tessellation can
+  // change the migration rate of many edges simultaneously
+  MatrixXd Hoo; SpMat Luo, Luu;
+  calc_laplacian(mColors,mEffcts,mrateMu,Hoo,Luo,Luu);
   // Read S1.4 Computing the resistance distances in the Supplementary
   // This computation is specific to the resistance distance metric
   // but the point is that we have a method to compute the between
   // demes component of the expected genetic dissimilarities from
   // the sparse matrix of migration rates
-  // Here instead of B, we compute its inverse Binv
-  MatrixXd Hinv = - M; Hinv.diagonal() += M.rowwise().sum(); Hinv.array() += 1.0;
+  // Here instead of B, we compute its inverse Binv = -S/2, where S is the Schur complement
+  // of the unobserved block in Hinv = L + 1*1'
+  Hoo.array() += 1.0;
   if (o==d) {
-    Binv = -0.5 * Hinv; // If all the demes are observed, it is quite easy to compute Binv
+    Binv = -0.5 * Hoo; // If all the demes are observed, it is quite easy to compute Binv
   } else {
-    Binv = -0.5 * Hinv.topLeftCorner(o,o);
-    Binv += 0.5 * Hinv.topRightCorner(o,d-o) *
-      Hinv.bottomRightCorner(d-o,d-o).selfadjointView<Lower>().llt().solve(Hinv.bottomLeftCorner(d-o,o));
+    // Huu = Luu + 1*1' is dense but it is a rank-one update of the sparse Luu, so
+    // Huu^{-1} = Luu^{-1} - z*z'/(1+t), where z = Luu^{-1}*1 and t = 1'*z (Sherman-Morrison)
+    // Luu is positive definite because the graph is connected and there is at least one observed deme
+    LuuLLT.factorize(Luu);
+    check_condition(LuuLLT.info() == Success, "calc_between : cannot factorize the Laplacian");
+    MatrixXd X(d-o,o+1);
+    X << MatrixXd(Luo), VectorXd::Ones(d-o);
+    X = LuuLLT.solve(X);
+    VectorXd z = X.col(o);
+    double t = z.sum();
+    // Y = Huu^{-1}*Huo, where Huo = Luo + 1*1'
+    // Y = Luu^{-1}*Luo + z*(1 - Luo'*z)'/(1+t)
+    MatrixXd Y = X.leftCols(o);
+    VectorXd y = VectorXd::Ones(o) - Luo.transpose() * z;
+    Y.noalias() += z * y.transpose() / (1.0 + t);
+    // Binv = -Hoo/2 + Hou*Huu^{-1}*Huo/2, where Hou = Huo' = Luo' + 1*1'
+    Binv = -0.5 * Hoo;
+    Binv.noalias() += 0.5 * (Luo.transpose() * Y);
+    Binv.rowwise() += 0.5 * Y.colwise().sum();
   }
   // The constant is slightly different for haploid and diploid species 
   Binv *= Binvconst;
 }
+/*
+  Refactorize the Laplacian of the current migration rates. This is the starting point for
+  the low-rank updates in update_between, so it has to be called whenever nowBinv changes.
+ */
+void EEMS::refactor_between( ) {
+  MatrixXd Loo; SpMat Luu;
+  calc_laplacian(nowmColors,nowmEffcts,nowmrateMu,Loo,nowLuo,Luu);
+  if (o==d) { return; }
+  nowLuuLLT.factorize(Luu);
+  check_condition(nowLuuLLT.info() == Success, "refactor_between : cannot factorize the Laplacian");
+  nowLuuOnes = nowLuuLLT.solve(VectorXd::Ones(d-o));
+}
+/*
+  Compute Binv after the migration rate of a few edges changes from m(e) to m(e) + delta(e),
+  starting from the current nowBinv rather than from scratch. The change to Hinv = L + 1*1' is
+  U*D*U', where D = diag(delta) and U has one column per edge, +1 at alpha and -1 at beta.
+  Then the Schur complement S = Hoo - Hou*inv(Huu)*Huo changes by
+    dS = Uo*D*Uo' - F*D*Uo' - Uo*D*F' - Uo*D*G*D*Uo' + F2*inv(C)*F2'
+  where K = inv(Huu)*Uu, G = Uu'*K, F = Hou*K, F2 = F + Uo*D*G and C = inv(D) + G (Woodbury)
+  This requires one sparse solve per edge and O(o^2 * edges) operations.
+ */
+void EEMS::update_between(const vector<int> &edges, const vector<double> &deltas, MatrixXd &Binv) const {
+  int k = edges.size();
+  MatrixXd Uo = MatrixXd::Zero(o,k);
+  MatrixXd Uu = MatrixXd::Zero(d-o,k);
+  VectorXd D(k);
+  int alpha, beta;
+  for ( int i = 0 ; i < k ; i++ ) {
+    graph.get_edge(edges[i],alpha,beta);
+    if (alpha < o) { Uo(alpha,i) = 1.0; } else { Uu(alpha-o,i) = 1.0; }
+    if (beta < o) { Uo(beta,i) = -1.0; } else { Uu(beta-o,i) = -1.0; }
+    D(i) = deltas[i];
+  }
+  MatrixXd P = Uo * D.asDiagonal();
+  MatrixXd dS = Uo * P.transpose();
+  if (o<d) {
+    // inv(Huu) = inv(Luu) - z*z'/(1+t), where z = inv(Luu)*1 and t = 1'*z
+    MatrixXd K = nowLuuLLT.solve(Uu);
+    K -= nowLuuOnes * (nowLuuOnes.transpose() * Uu) / (1.0 + nowLuuOnes.sum());
+    MatrixXd G = Uu.transpose() * K;
+    // Hou = Luo' + 1*1'
+    MatrixXd F = nowLuo.transpose() * K;
+    F.rowwise() += K.colwise().sum();
+    MatrixXd F2 = F + P * G;
+    MatrixXd C = G; C.diagonal() += D.cwiseInverse();
+    dS.noalias() -= F * P.transpose();
+    dS.noalias() -= P * F.transpose();
+    dS.noalias() -= P * G * P.transpose();
+    dS.noalias() += F2 * C.partialPivLu().solve(F2.transpose());
+  }
+  // Binv = -Binvconst * S/2
+  Binv = nowBinv - 0.5 * Binvconst * dS;
+}
+// The likelihood depends on B = inv(Binv), which changes only when the migration rates change.
+// So B is computed once per migration proposal, and it is cached as nowB for the diversity proposals
+void EEMS::calc_inverse_between(const MatrixXd &Binv, MatrixXd &B) const {
+  B = Binv.selfadjointView<Lower>().ldlt().solve(MatrixXd::Identity(o,o));
+}
 /*
   This function implements the computations described in the Section S1.3 in the Supplementary Information,
   "Computing the Wishart log likelihood l(k, m, q, sigma2)", and I have tried to used similar notation
   For example, MatrixXd X = lu.solve(T) is equation (S20)
   since lu is the decomposition of (B*C - W) and T is B * inv(W)
   Returns wishpdfln( -L*D*L' ; - (sigma2/df) * L*Delta(m,q)*L' , df )
+  The between demes component is passed as B = inv(Binv), see calc_inverse_between
  */
-double EEMS::EEMS_wishpdfln(const MatrixXd &Binv, const VectorXd &W, const double sigma2, const double df,
+double EEMS::EEMS_wishpdfln(const MatrixXd &B, const VectorXd &W, const double sigma2, const double df,
 			    double &triDeltaQD, double &ll_atfixdf) const {
   double df_2 = 0.5 * df;
-  MatrixXd T = Binv.selfadjointView<Lower>().ldlt().solve(MatrixXd::Identity(o,o));
+  MatrixXd T = B;
   T *= cvec.asDiagonal(); T -= W.asDiagonal();             // Now T = B*C - W
   PartialPivLU<MatrixXd> lu(T);
   VectorXd Winv = pow(W.array(),-1.0);
@@ -345,46 +479,177 @@ double EEMS::EEMS_wishpdfln(const MatrixXd &Binv, const VectorXd &W, const doubl
   ll_atfixdf = ldetDinvQ - triDeltaQD/sigma2 - nmin1*log(sigma2) - ldDiQ;
   return (df_2*ll_atfixdf + nmin1*df_2*log(df_2) - mvgammaln(df_2,nmin1) - n_2*ldLDLt);
 }
+/*
+  Refactorize T = B*C - W for the current B and W. This is the starting point for
+  the low-rank updates in EEMS_wishpdfln_within, so it has to be called whenever nowB changes.
+ */
+void EEMS::refactor_within( ) {
+  MatrixXd T = nowB;
+  T *= cvec.asDiagonal(); T -= nowW.asDiagonal();
+  PartialPivLU<MatrixXd> lu(T);
+  nowTinv = lu.inverse();
+  nowTinvOnes = nowTinv.rowwise().sum();
+  nowldT = lu.matrixLU().diagonal().array().abs().log().sum();
+  nowtrTinvE = nowTinv.cwiseProduct(JtDobsJCinv).sum();
+}
+/*
+  A diversity proposal changes W on a few demes only, so T = B*C - W changes by -P*D*P', where
+  D = diag(newW - nowW) on the r demes that change and P selects these demes. By Woodbury,
+    inv(T - P*D*P') = inv(T) + inv(T)*P*N*P'*inv(T), where N = inv(M)*D and M = I - D*P'*inv(T)*P
+  and det(T - P*D*P') = det(T)*det(M).
+  Returns false if too many demes change, in which case the full computation is cheaper.
+ */
+bool EEMS::lowrank_within(const VectorXd &W, MatrixXd &TinvPN, MatrixXd &PtTinv, double &ldM) const {
+  vector<int> demes;
+  for ( int alpha = 0 ; alpha < o ; alpha++ ) {
+    if (W(alpha) != nowW(alpha)) { demes.push_back(alpha); }
+  }
+  int r = demes.size();
+  // The update requires O(o^2 * r) operations, while the full computation requires O(o^3)
+  if (2*r > o) { return false; }
+  MatrixXd TinvP(o,r);
+  PtTinv.resize(r,o);
+  VectorXd D(r);
+  for ( int i = 0 ; i < r ; i++ ) {
+    TinvP.col(i) = nowTinv.col(demes[i]);
+    PtTinv.row(i) = nowTinv.row(demes[i]);
+    D(i) = W(demes[i]) - nowW(demes[i]);
+  }
+  ldM = 0.0;
+  TinvPN.resize(o,r);
+  if (r==0) { return true; }
+  MatrixXd M = MatrixXd::Identity(r,r);
+  for ( int i = 0 ; i < r ; i++ ) {
+    M.row(i) -= D(i) * PtTinv.row(i)(demes);
+  }
+  PartialPivLU<MatrixXd> lu(M);
+  TinvPN.noalias() = TinvP * lu.solve(MatrixXd(D.asDiagonal()));
+  ldM = lu.matrixLU().diagonal().array().abs().log().sum();
+  return true;
+}
+// Update the cached inv(B*C - W) after a diversity proposal is accepted
+void EEMS::update_within(const VectorXd &W) {
+  MatrixXd TinvPN, PtTinv; double ldM;
+  bool lowrank = lowrank_within(W,TinvPN,PtTinv,ldM);
+  nowW = W;
+  if (!lowrank) { refactor_within(); return; }
+  nowTinv.noalias() += TinvPN * PtTinv;
+  nowTinvOnes = nowTinv.rowwise().sum();
+  nowldT += ldM;
+  nowtrTinvE = nowTinv.cwiseProduct(JtDobsJCinv).sum();
+}
+/*
+  The same as EEMS_wishpdfln(nowB,W,...) but using the cached inv(T) = inv(nowB*C - nowW), see lowrank_within
+  Since B*inv(W) = T*inv(W)*inv(C) + inv(C), the matrix X in EEMS_wishpdfln is X = inv(C*W) + inv(T)*inv(C),
+  so X*c - inv(W)*1 = inv(T)*1 and tr(X*JtDobsJ) = sum(diag(JtDobsJ)./(c.*w)) + sum(inv(T) .* JtDobsJ*inv(C))
+ */
+double EEMS::EEMS_wishpdfln_within(const VectorXd &W, const double sigma2, const double df,
+				   double &triDeltaQD, double &ll_atfixdf) const {
+  MatrixXd TinvPN, PtTinv; double ldM;
+  if (!lowrank_within(W,TinvPN,PtTinv,ldM)) {
+    return (EEMS_wishpdfln(nowB,W,sigma2,df,triDeltaQD,ll_atfixdf));
+  }
+  double df_2 = 0.5 * df;
+  VectorXd Winv = pow(W.array(),-1.0);
+  VectorXd Xc_Winv = nowTinvOnes + TinvPN * PtTinv.rowwise().sum();
+  double oDinvo = cvec.dot(Xc_Winv);                       // oDinvo = 1'*inv(Delta)*1
+  double oDiDDi = Xc_Winv.transpose()*JtDobsJ*Xc_Winv;     // oDiDDi = 1'*inv(Delta)*D*inv(D)*1
+  double trXD = JtDobsJ.diagonal().cwiseProduct(cinv).dot(Winv) + nowtrTinvE
+    + TinvPN.cwiseProduct(JtDobsJCinv * PtTinv.transpose()).sum();
+  triDeltaQD = trXD - oDiDDi/oDinvo;                       // triDeltaQD = tr(inv(Delta)*Q*D)
+  double ldetDinvQ = logn - log(abs(oDinvo))               // ldetDinvQ = logDet(-inv(Delta)*Q)
+    + cmin1.dot(Winv.array().log().matrix())               // log(det(W_n) * det(inv(W_o)))
+    - nowldT - ldM;                                        // log(abs(det(B*C - W)))
+  ll_atfixdf = ldetDinvQ - triDeltaQD/sigma2 - nmin1*log(sigma2) - ldDiQ;
+  return (df_2*ll_atfixdf + nmin1*df_2*log(df_2) - mvgammaln(df_2,nmin1) - n_2*ldLDLt);
+}
 double EEMS::eval_proposal_rate_one_qtile(Proposal &proposal) const {
   calc_within(nowqColors,proposal.newqEffcts,proposal.newW);
-  return (EEMS_wishpdfln(nowBinv,proposal.newW,nowsigma2,nowdf,proposal.newtriDeltaQD,proposal.newll_atfixdf));
+  return (EEMS_wishpdfln_within(proposal.newW,nowsigma2,nowdf,proposal.newtriDeltaQD,proposal.newll_atfixdf));
 }
 double EEMS::eval_proposal_move_one_qtile(Proposal &proposal) const {
-  graph.index_closest_to_deme(proposal.newqSeeds,proposal.newqColors);
+  // Only the demes in the moved tile, or closer to its new seed, change color
+  proposal.newqColors = nowqColors;
+  graph.update_closest_to_deme(proposal.newqSeeds,proposal.tile,proposal.newqColors);
   calc_within(proposal.newqColors,nowqEffcts,proposal.newW);
-  return (EEMS_wishpdfln(nowBinv,proposal.newW,nowsigma2,nowdf,proposal.newtriDeltaQD,proposal.newll_atfixdf));
+  return (EEMS_wishpdfln_within(proposal.newW,nowsigma2,nowdf,proposal.newtriDeltaQD,proposal.newll_atfixdf));
 }
 double EEMS::eval_birthdeath_qVoronoi(Proposal &proposal) const {
-  graph.index_closest_to_deme(proposal.newqSeeds,proposal.newqColors);
+  proposal.newqColors = nowqColors;
+  if (proposal.newqtiles > nowqtiles) {
+    graph.update_closest_to_deme(proposal.newqSeeds,proposal.tile,proposal.newqColors);
+  } else {
+    graph.remove_closest_to_deme(proposal.newqSeeds,proposal.tile,proposal.newqColors);
+  }
   calc_within(proposal.newqColors,proposal.newqEffcts,proposal.newW);
-  return (EEMS_wishpdfln(nowBinv,proposal.newW,nowsigma2,nowdf,proposal.newtriDeltaQD,proposal.newll_atfixdf));
+  return (EEMS_wishpdfln_within(proposal.newW,nowsigma2,nowdf,proposal.newtriDeltaQD,proposal.newll_atfixdf));
 }
 double EEMS::eval_proposal_rate_one_mtile(Proposal &proposal) const {
-  calc_between(nowmColors,proposal.newmEffcts,nowmrateMu,proposal.newBinv);
-  return (EEMS_wishpdfln(proposal.newBinv,nowW,nowsigma2,nowdf,proposal.newtriDeltaQD,proposal.newll_atfixdf));
+  // Only the edges that connect a deme in the updated tile change their migration rate
+  vector<int> edges;
+  vector<double> deltas;
+  int alpha, beta;
+  for ( int edge = 0 ; edge < graph.get_num_edges() ; edge++ ) {
+    graph.get_edge(edge,alpha,beta);
+    double nowmEffct_alpha = nowmEffcts(nowmColors(alpha)), newmEffct_alpha = proposal.newmEffcts(nowmColors(alpha));
+    double nowmEffct_beta = nowmEffcts(nowmColors(beta)), newmEffct_beta = proposal.newmEffcts(nowmColors(beta));
+    if ((nowmEffct_alpha != newmEffct_alpha) || (nowmEffct_beta != newmEffct_beta)) {
+      double delta = 0.5 * pow(10.0,nowmrateMu) *
+	(pow(10.0,newmEffct_alpha) + pow(10.0,newmEffct_beta) - pow(10.0,nowmEffct_alpha) - pow(10.0,nowmEffct_beta));
+      if (delta != 0.0) { edges.push_back(edge); deltas.push_back(delta); }
+    }
+  }
+  // The low-rank update solves a system with one right-hand side per edge, while the full
+  // computation solves a system with one right-hand side per observed deme
+  if (edges.size() <= (size_t)o) {
+    update_between(edges,deltas,proposal.newBinv);
+  } else {
+    calc_between(nowmColors,proposal.newmEffcts,nowmrateMu,proposal.newBinv);
+  }
+  calc_inverse_between(proposal.newBinv,proposal.newB);
+  return (EEMS_wishpdfln(proposal.newB,nowW,nowsigma2,nowdf,proposal.newtriDeltaQD,proposal.newll_atfixdf));
 }
 double EEMS::eval_proposal_overall_mrate(Proposal &proposal) const {
-  calc_between(nowmColors,nowmEffcts,proposal.newmrateMu,proposal.newBinv);
-  return (EEMS_wishpdfln(proposal.newBinv,nowW,nowsigma2,nowdf,proposal.newtriDeltaQD,proposal.newll_atfixdf));
+  // All migration rates are scaled by the same factor c, so L becomes c*L and
+  // inv(c*L + 1*1') = inv(L + 1*1')/c + (1-1/c)*1*1'/d^2 because inv(L + 1*1') = pinv(L) + 1*1'/d^2
+  // Therefore the new Binv is a rank-one update of the current Binv (Sherman-Morrison)
+  double c = pow(10.0,proposal.newmrateMu - nowmrateMu);
+  double gamma = 2.0 * (c - 1.0) / (Binvconst * d * d);
+  VectorXd b = nowBinv.rowwise().sum();
+  proposal.newBinv = nowBinv;
+  proposal.newBinv.noalias() += (gamma / (1.0 - gamma * b.sum())) * b * b.transpose();
+  proposal.newBinv *= c;
+  calc_inverse_between(proposal.newBinv,proposal.newB);
+  return (EEMS_wishpdfln(proposal.newB,nowW,nowsigma2,nowdf,proposal.newtriDeltaQD,proposal.newll_atfixdf));
 }
 // Propose to move one tile in the migration Voronoi tessellation
 double EEMS::eval_proposal_move_one_mtile(Proposal &proposal) const {
-  graph.index_closest_to_deme(proposal.newmSeeds,proposal.newmColors);
+  // Only the demes in the moved tile, or closer to its new seed, change color
+  proposal.newmColors = nowmColors;
+  graph.update_closest_to_deme(proposal.newmSeeds,proposal.tile,proposal.newmColors);
   calc_between(proposal.newmColors,nowmEffcts,nowmrateMu,proposal.newBinv);
-  return (EEMS_wishpdfln(proposal.newBinv,nowW,nowsigma2,nowdf,proposal.newtriDeltaQD,proposal.newll_atfixdf));
+  calc_inverse_between(proposal.newBinv,proposal.newB);
+  return (EEMS_wishpdfln(proposal.newB,nowW,nowsigma2,nowdf,proposal.newtriDeltaQD,proposal.newll_atfixdf));
 }
 double EEMS::eval_birthdeath_mVoronoi(Proposal &proposal) const {
-  graph.index_closest_to_deme(proposal.newmSeeds,proposal.newmColors);
+  proposal.newmColors = nowmColors;
+  if (proposal.newmtiles > nowmtiles) {
+    graph.update_closest_to_deme(proposal.newmSeeds,proposal.tile,proposal.newmColors);
+  } else {
+    graph.remove_closest_to_deme(proposal.newmSeeds,proposal.tile,proposal.newmColors);
+  }
   calc_between(proposal.newmColors,proposal.newmEffcts,nowmrateMu,proposal.newBinv);
-  return (EEMS_wishpdfln(proposal.newBinv,nowW,nowsigma2,nowdf,proposal.newtriDeltaQD,proposal.newll_atfixdf));
+  calc_inverse_between(proposal.newBinv,proposal.newB);
+  return (EEMS_wishpdfln(proposal.newB,nowW,nowsigma2,nowdf,proposal.newtriDeltaQD,proposal.newll_atfixdf));
 }
 ///////////////////////////////////////////
 void EEMS::update_sigma2( ) {
   double nowdf_2 = 0.5 * nowdf;
   nowll_atfixdf += nowtriDeltaQD/nowsigma2 + nmin1*log(nowsigma2);
   nowpi += (params.sigmaShape_2+1.0)*log(nowsigma2) + params.sigmaScale_2/nowsigma2;
-  nowsigma2 = draw.rinvgam( params.sigmaShape_2 + nowdf_2*nmin1,
-			    params.sigmaScale_2 + nowdf_2*nowtriDeltaQD );
+  // For a heated chain, the likelihood terms in the full conditional are scaled by the inverse temperature
+  nowsigma2 = draw.rinvgam( params.sigmaShape_2 + invTemperature*nowdf_2*nmin1,
+			    params.sigmaScale_2 + invTemperature*nowdf_2*nowtriDeltaQD );
   nowll_atfixdf -= nowtriDeltaQD/nowsigma2 + nmin1*log(nowsigma2);
   nowpi -= (params.sigmaShape_2+1.0)*log(nowsigma2) + params.sigmaScale_2/nowsigma2;
   nowll = nowdf_2 * nowll_atfixdf + nmin1*nowdf_2*log(nowdf_2) - mvgammaln(nowdf_2,nmin1) - n_2*ldLDLt;
@@ -477,6 +742,7 @@ void EEMS::propose_move_one_qtile(Proposal &proposal) {
   double newqSeedx = draw.rnorm(nowqSeeds(qtile,0),params.qSeedsProposalS2x);
   double newqSeedy = draw.rnorm(nowqSeeds(qtile,1),params.qSeedsProposalS2y);
   proposal.move = Q_VORONOI_POINT_MOVE;
+  proposal.tile = qtile;
   proposal.newqSeeds = nowqSeeds;
   proposal.newqSeeds(qtile,0) = newqSeedx;
   proposal.newqSeeds(qtile,1) = newqSeedy;
@@ -496,6 +762,7 @@ void EEMS::propose_move_one_mtile(Proposal &proposal) {
   double newmSeedx = draw.rnorm(nowmSeeds(mtile,0),params.mSeedsProposalS2x);
   double newmSeedy = draw.rnorm(nowmSeeds(mtile,1),params.mSeedsProposalS2y);
   proposal.move = M_VORONOI_POINT_MOVE;
+  proposal.tile = mtile;
   proposal.newmSeeds = nowmSeeds;
   proposal.newmSeeds(mtile,0) = newmSeedx;
   proposal.newmSeeds(mtile,1) = newmSeedy;
@@ -524,6 +791,7 @@ void EEMS::propose_birthdeath_qVoronoi(Proposal &proposal) {
     double nowqEffct = nowqEffcts(r);
     double newqEffct = draw.rtrnorm(nowqEffct,params.qEffctProposalS2,params.qEffctHalfInterval);
     insertRow(proposal.newqSeeds,newqSeed.row(0));
+    proposal.tile = nowqtiles;
     insertElem(proposal.newqEffcts,newqEffct);
     // Compute log(proposal ratio) and log(prior ratio)
     proposal.newratioln = log(pDeath/pBirth)
@@ -537,6 +805,7 @@ void EEMS::propose_birthdeath_qVoronoi(Proposal &proposal) {
     int qtileToRemove = draw.runif_int(0,newqtiles);
     MatrixXd oldqSeed = nowqSeeds.row(qtileToRemove);
     removeRow(proposal.newqSeeds,qtileToRemove);
+    proposal.tile = qtileToRemove;
     removeElem(proposal.newqEffcts,qtileToRemove);
     pairwise_distance(proposal.newqSeeds,oldqSeed).col(0).minCoeff(&r);
     double nowqEffct = proposal.newqEffcts(r);
@@ -567,6 +836,7 @@ void EEMS::propose_birthdeath_mVoronoi(Proposal &proposal) {
     double nowmEffct = nowmEffcts(r);
     double newmEffct = draw.rtrnorm(nowmEffct,params.mEffctProposalS2,params.mEffctHalfInterval);
     insertRow(proposal.newmSeeds,newmSeed.row(0));
+    proposal.tile = nowmtiles;
     insertElem(proposal.newmEffcts,newmEffct);
     // Compute log(prior ratio) and log(proposal ratio)
     proposal.newratioln = log(pDeath/pBirth)
@@ -580,6 +850,7 @@ void EEMS::propose_birthdeath_mVoronoi(Proposal &proposal) {
     int mtileToRemove = draw.runif_int(0,newmtiles);
     MatrixXd oldmSeed = nowmSeeds.row(mtileToRemove);
     removeRow(proposal.newmSeeds,mtileToRemove);
+    proposal.tile = mtileToRemove;
     removeElem(proposal.newmEffcts,mtileToRemove);
     pairwise_distance(proposal.newmSeeds,oldmSeed).col(0).minCoeff(&r);
     double nowmEffct = proposal.newmEffcts(r);
@@ -611,7 +882,7 @@ bool EEMS::accept_proposal(Proposal &proposal) {
     proposal.newll = nowll;
     return false;
   }
-  double ratioln = proposal.newpi - nowpi + proposal.newll - nowll;
+  double ratioln = proposal.newpi - nowpi + invTemperature * (proposal.newll - nowll);
   // If the proposal is either birth or death, add the log(proposal ratio)
   if (proposal.move==Q_VORONOI_BIRTH_DEATH || proposal.move==M_VORONOI_BIRTH_DEATH) {
     ratioln += proposal.newratioln;
@@ -620,32 +891,35 @@ bool EEMS::accept_proposal(Proposal &proposal) {
     switch (proposal.move) {
     case Q_VORONOI_RATE_UPDATE:
       nowqEffcts = proposal.newqEffcts;
-      nowW = proposal.newW;
+      update_within(proposal.newW);
       break;
     case Q_VORONOI_POINT_MOVE:
       nowqSeeds = proposal.newqSeeds;
       nowqColors = proposal.newqColors;
-      nowW = proposal.newW;
+      update_within(proposal.newW);
       break;
     case Q_VORONOI_BIRTH_DEATH:
       nowqSeeds = proposal.newqSeeds;
       nowqEffcts = proposal.newqEffcts;
       nowqtiles = proposal.newqtiles;
       nowqColors = proposal.newqColors;
-      nowW = proposal.newW;
+      update_within(proposal.newW);
       break;
     case M_VORONOI_RATE_UPDATE:
       nowmEffcts = proposal.newmEffcts;
       nowBinv = proposal.newBinv;
+      nowB = proposal.newB;
       break;
     case M_MEAN_RATE_UPDATE:
       nowmrateMu = proposal.newmrateMu;
       nowBinv = proposal.newBinv;
+      nowB = proposal.newB;
       break;
     case M_VORONOI_POINT_MOVE:
       nowmSeeds = proposal.newmSeeds;
       nowmColors = proposal.newmColors;
       nowBinv = proposal.newBinv;
+      nowB = proposal.newB;
       break;
     case M_VORONOI_BIRTH_DEATH:
       nowmSeeds = proposal.newmSeeds;
@@ -653,6 +927,7 @@ bool EEMS::accept_proposal(Proposal &proposal) {
       nowmtiles = proposal.newmtiles;
       nowmColors = proposal.newmColors;
       nowBinv = proposal.newBinv;
+      nowB = proposal.newB;
       break;
     case DF_UPDATE:
       nowdf = proposal.newdf;
@@ -661,6 +936,12 @@ bool EEMS::accept_proposal(Proposal &proposal) {
       cerr << "[RJMCMC] Unknown move type" << endl;
       exit(1);
     }
+    // The low-rank updates of Binv start from the Laplacian of the current migration rates
+    if (proposal.move==M_VORONOI_RATE_UPDATE || proposal.move==M_MEAN_RATE_UPDATE ||
+	proposal.move==M_VORONOI_POINT_MOVE || proposal.move==M_VORONOI_BIRTH_DEATH) {
+      refactor_between( );
+      refactor_within( );
+    }
     nowpi = proposal.newpi;
     nowll = proposal.newll;
     nowtriDeltaQD = proposal.newtriDeltaQD;
@@ -682,37 +963,24 @@ void EEMS::print_iteration(const MCMC &mcmc) const {
        << "          Log prior = " << nowpi << endl
        << "          Log llike = " << nowll << endl;
 }
-void EEMS::save_iteration(const MCMC &mcmc) {
-  int iter = mcmc.index_saved_iteration( );
-  mcmcthetas(iter,0) = nowsigma2;
-  mcmcthetas(iter,1) = nowdf;
-  mcmcqhyper(iter,0) = 0.0;
-  mcmcqhyper(iter,1) = nowqrateS2;
-  mcmcmhyper(iter,0) = nowmrateMu;
-  mcmcmhyper(iter,1) = nowmrateS2;
-  mcmcpilogl(iter,0) = nowpi;
-  mcmcpilogl(iter,1) = nowll;
-  mcmcqtiles(iter) = nowqtiles;
-  mcmcmtiles(iter) = nowmtiles;
-  for ( int t = 0 ; t < nowqtiles ; t++ ) {
-    mcmcqRates.push_back(pow(10.0,nowqEffcts(t)));
-  }
-  for ( int t = 0 ; t < nowqtiles ; t++ ) {
-    mcmcwCoord.push_back(nowqSeeds(t,0));
-  }
-  for ( int t = 0 ; t < nowqtiles ; t++ ) {
-    mcmczCoord.push_back(nowqSeeds(t,1));
-  }
-  for ( int t = 0 ; t < nowmtiles ; t++ ) {
-    mcmcmRates.push_back(pow(10.0,nowmEffcts(t) + nowmrateMu));
-  }
-  for ( int t = 0 ; t < nowmtiles ; t++ ) {
-    mcmcxCoord.push_back(nowmSeeds(t,0));
-  }
-  for ( int t = 0 ; t < nowmtiles ; t++ ) {
-    mcmcyCoord.push_back(nowmSeeds(t,1));
-  }
-  MatrixXd B = nowBinv.inverse();
+void EEMS::save_iteration( ) {
+  SavedIteration iteration;
+  iteration.sigma2 = nowsigma2;
+  iteration.df = nowdf;
+  iteration.qrateS2 = nowqrateS2;
+  iteration.mrateMu = nowmrateMu;
+  iteration.mrateS2 = nowmrateS2;
+  iteration.pi = nowpi;
+  iteration.ll = nowll;
+  iteration.qRates = pow(10.0,nowqEffcts.array());
+  iteration.wCoord = nowqSeeds.col(0);
+  iteration.zCoord = nowqSeeds.col(1);
+  iteration.mRates = pow(10.0,nowmEffcts.array() + nowmrateMu);
+  iteration.xCoord = nowmSeeds.col(0);
+  iteration.yCoord = nowmSeeds.col(1);
+  writer->push(iteration);
+  niters++;
+  MatrixXd B = nowB;
   VectorXd h = B.diagonal();    // If B = -2H, then diag(B) = -2diag(H) = -2h
   B -= 0.5 * h.replicate(1,o);  // Therefore 1h' + h1' - 2H = -1diag(B)'/2 - diag(B)1'/2 + B
   B -= 0.5 * h.transpose().replicate(o,1);
@@ -763,23 +1031,11 @@ void EEMS::output_results(const MCMC &mcmc) const {
   // which is appropriate as we need at least two observations to compute dissimilarities.
   MatrixXd Pairs = cvec*cvec.transpose(); Pairs -= cvec.asDiagonal();
   MatrixXd oDemes = MatrixXd::Zero(o,3);
-  int niters = mcmc.num_iters_to_save();
   oDemes << graph.get_the_obsrv_demes(), cvec;
   dlmwrite(params.mcmcpath + "/rdistoDemes.txt", oDemes);
   dlmwrite(params.mcmcpath + "/rdistJtDobsJ.txt", JtDobsJ.cwiseQuotient(Pairs));
   dlmwrite(params.mcmcpath + "/rdistJtDhatJ.txt", JtDhatJ/niters);
-  dlmwrite(params.mcmcpath + "/mcmcqtiles.txt", mcmcqtiles);
-  dlmwrite(params.mcmcpath + "/mcmcmtiles.txt", mcmcmtiles);
-  dlmwrite(params.mcmcpath + "/mcmcthetas.txt", mcmcthetas);
-  dlmwrite(params.mcmcpath + "/mcmcqhyper.txt", mcmcqhyper);
-  dlmwrite(params.mcmcpath + "/mcmcmhyper.txt", mcmcmhyper);
-  dlmwrite(params.mcmcpath + "/mcmcpilogl.txt", mcmcpilogl);
-  dlmcell(params.mcmcpath + "/mcmcmrates.txt",mcmcmtiles,mcmcmRates);
-  dlmcell(params.mcmcpath + "/mcmcxcoord.txt",mcmcmtiles,mcmcxCoord);
-  dlmcell(params.mcmcpath + "/mcmcycoord.txt",mcmcmtiles,mcmcyCoord);
-  dlmcell(params.mcmcpath + "/mcmcqrates.txt",mcmcqtiles,mcmcqRates);
-  dlmcell(params.mcmcpath + "/mcmcwcoord.txt",mcmcqtiles,mcmcwCoord);
-  dlmcell(params.mcmcpath + "/mcmczcoord.txt",mcmcqtiles,mcmczCoord);
+  writer->close( );
   output_current_state( );
   out.open((params.mcmcpath + "/eemsrun.txt").c_str(), ofstream::app);
   out << "Acceptance proportions:" << endl << mcmc << endl
@@ -791,11 +1047,39 @@ void EEMS::output_results(const MCMC &mcmc) const {
        << "Final log prior: " << nowpi << endl
        << "Final log llike: " << nowll << endl;
 }
+void EEMS::set_inverse_temperature(const double invTemperature) { this->invTemperature = invTemperature; }
+double EEMS::get_inverse_temperature( ) const { return (invTemperature); }
+double EEMS::get_log_likelihood( ) const { return (nowll); }
+// Exchange the current parameter values with another chain (which shares the same data),
+// but keep the temperature, the random number generator and the saved MCMC draws
+void EEMS::swap_state(EEMS &other) {
+  swap(nowmtiles,other.nowmtiles); swap(nowqtiles,other.nowqtiles);
+  swap(nowmSeeds,other.nowmSeeds); swap(nowmEffcts,other.nowmEffcts); swap(nowmrateMu,other.nowmrateMu);
+  swap(nowqSeeds,other.nowqSeeds); swap(nowqEffcts,other.nowqEffcts);
+  swap(nowqrateS2,other.nowqrateS2); swap(nowmrateS2,other.nowmrateS2);
+  swap(nowsigma2,other.nowsigma2); swap(nowpi,other.nowpi); swap(nowll,other.nowll); swap(nowdf,other.nowdf);
+  swap(nowtriDeltaQD,other.nowtriDeltaQD); swap(nowll_atfixdf,other.nowll_atfixdf);
+  swap(nowqColors,other.nowqColors); swap(nowmColors,other.nowmColors);
+  swap(nowW,other.nowW); swap(nowBinv,other.nowBinv); swap(nowB,other.nowB);
+  // The factorizations that depend on the current state have to be recomputed
+  refactor_between(); refactor_within();
+  other.refactor_between(); other.refactor_within();
+}
 void EEMS::check_ll_computation( ) const {
   double pi0 = test_prior(nowmSeeds,nowmEffcts,nowmrateMu,nowqSeeds,nowqEffcts,nowdf,nowsigma2,nowmrateS2,nowqrateS2);
   double ll0 = test_likelihood(nowmSeeds,nowmEffcts,nowmrateMu,nowqSeeds,nowqEffcts,nowdf,nowsigma2);
   check_condition( abs(nowll - ll0) / abs(ll0) < 1e-12, "ll0 != ll");
   check_condition( abs(nowpi - pi0) / abs(pi0) < 1e-12, "pi0 != pi");
+  // The diversity proposals use the cached inv(B*C - W) rather than the full computation
+  double triDeltaQD, ll_atfixdf;
+  double ll1 = EEMS_wishpdfln_within(nowW,nowsigma2,nowdf,triDeltaQD,ll_atfixdf);
+  check_condition( abs(ll1 - ll0) / abs(ll0) < 1e-12, "ll0 != ll (within)");
+  // The point move and birth/death proposals update the colors incrementally
+  VectorXi mColors, qColors;
+  graph.index_closest_to_deme(nowmSeeds,mColors);
+  graph.index_closest_to_deme(nowqSeeds,qColors);
+  check_condition( mColors == nowmColors, "mColors != nowmColors");
+  check_condition( qColors == nowqColors, "qColors != nowqColors");
 }
 double EEMS::test_prior(const MatrixXd &mSeeds, const VectorXd &mEffcts, const double mrateMu,
 			const MatrixXd &qSeeds, const VectorXd &qEffcts,
@@ -5,6 +5,9 @@
 #include "draw.hpp"
 #include "graph.hpp"
 #include "habitat.hpp"
+#include "writer.hpp"
+
+#include <boost/shared_ptr.hpp>
 
 #ifndef EEMS_H
 #define EEMS_H
@@ -28,6 +31,7 @@ struct Proposal {
   MoveType move; // the type of proposal/update
   int newqtiles; // number of m and q tiles, respectively
   int newmtiles;
+  int tile; // the tile that is moved, added or removed by a point move or a birth/death proposal
   double newdf; // degrees of freedom
   double newpi; // log prior
   double newll; // log likelihood
@@ -42,19 +46,61 @@ struct Proposal {
   MatrixXd newmSeeds;  // the location of each m tile within the habitat
   VectorXd newW;    // the within demes component, one entry for each deme in the habitat
   MatrixXd newBinv; // the between demes component, one entry for each pair of demes in the habitat (actually, its inverse)
+  MatrixXd newB;    // the between demes component, B = inv(Binv)
   VectorXi newqColors; // mapping that indicates which q tiles each vertex/deme falls into
   VectorXi newmColors; // mapping that indicates which m tiles each vertex/deme falls into
 };
 
+/*
+  The data and everything derived from it alone: the habitat, the population grid and
+  the observed dissimilarities. These do not change during the MCMC, so several chains
+  (running on separate threads) can share one copy, see EEMS(params,data).
+*/
+class EEMSData {
+public:
+
+  EEMSData(const Params &params);
+  ~EEMSData( );
+
+  string mcmcpath; // the output directory where the habitat and the grid are written
+  Graph graph;
+  Habitat habitat;
+
+  int o; // observed demes
+  int d; // all demes
+  int n; // nIndiv
+  int p; // nSites
+  MatrixXd Diffs;
+  MatrixXd L;
+  MatrixXd J;
+  // cvec, cinv, cmin1 are used to compute EEMS_wishpdfln
+  VectorXd cvec; // c is the vector of counts
+  VectorXd cinv;  // cinv is the vector of inverse counts
+  VectorXd cmin1;  // cmin1 is the vector of counts - 1
+  MatrixXd JtDobsJ;
+  MatrixXd JtDobsJCinv; // JtDobsJ*inv(C), where C = diag(cvec)
+  double ldLLt; // logdet(L*L')
+  double ldDiQ;  // logdet(inv(Diffs)*Q)
+  double ldLDLt;  // logdet(-L*Diffs*L')
+  double n_2, logn; int nmin1; // n/2, log(n), n-1
+
+private:
+
+  void initialize_diffs(const Params &params);
+
+};
+
 class EEMS {
 public:
 
   EEMS(const Params &params);
+  // Start another chain that shares the data (but not the random number generator) with other chains
+  EEMS(const Params &params, const boost::shared_ptr<const EEMSData> &data);
   ~EEMS( );
 
   void initialize_state( );
   void load_final_state( );
-  bool start_eems(const MCMC &mcmc);
+  bool start_eems( );
   double eval_prior( );
   double eval_likelihood( );
   double test_prior(const MatrixXd &mSeeds, const VectorXd &mEffcts, const double mrateMu,
@@ -65,6 +111,10 @@ public:
 			 const double df, const double sigma2) const;
   void calc_within(const VectorXi &qColors, const VectorXd &qEffcts, VectorXd &W) const;
   void calc_between(const VectorXi &mColors, const VectorXd &mEffcts, const double mrateMu, MatrixXd &Binv) const;
+  void update_between(const vector<int> &edges, const vector<double> &deltas, MatrixXd &Binv) const;
+  void calc_inverse_between(const MatrixXd &Binv, MatrixXd &B) const;
+  void calc_laplacian(const VectorXi &mColors, const VectorXd &mEffcts, const double mrateMu,
+		      MatrixXd &Loo, SpMat &Luo, SpMat &Luu) const;
   MoveType choose_move_type( );
   // These functions change the within demes component:
   double eval_proposal_rate_one_qtile(Proposal &proposal) const;
@@ -91,10 +141,15 @@ public:
   bool accept_proposal(Proposal &proposal);
 
   void print_iteration(const MCMC &mcmc) const;
-  void save_iteration(const MCMC &mcmc);
+  void save_iteration( );
   void output_results(const MCMC &mcmc) const;
   void output_current_state() const;
   void check_ll_computation() const;
+  // Parallel tempering: a heated chain samples from prior * likelihood^invTemperature
+  void set_inverse_temperature(const double invTemperature);
+  double get_inverse_temperature() const;
+  double get_log_likelihood() const;
+  void swap_state(EEMS &other);
   string datapath() const;
   string mcmcpath() const;
   string prevpath() const;
@@ -103,29 +158,29 @@ public:
 private:
 
   Draw draw; // Random number generator
-  Graph graph;
   Params params;
-  Habitat habitat;
+  boost::shared_ptr<const EEMSData> data;
+  const Graph &graph;
+  const Habitat &habitat;
 
-  // Diffs:
-  int o; // observed demes
-  int d; // all demes
-  int n; // nIndiv
-  int p; // nSites
-  MatrixXd Diffs;
-  MatrixXd L;
-  MatrixXd J;
-  // cvec, cinv, cmin1 are used to compute EEMS_wishpdfln
-  VectorXd cvec; // c is the vector of counts
-  VectorXd cinv;  // cinv is the vector of inverse counts
-  VectorXd cmin1;  // cmin1 is the vector of counts - 1
-  MatrixXd JtDobsJ;
+  // Diffs (shared with other chains, see EEMSData):
+  const int o, d, n, p;
+  const MatrixXd &Diffs;
+  const MatrixXd &L;
+  const MatrixXd &J;
+  const VectorXd &cvec;
+  const VectorXd &cinv;
+  const VectorXd &cmin1;
+  const MatrixXd &JtDobsJ;
+  const MatrixXd &JtDobsJCinv;
+  const double ldLLt, ldDiQ, ldLDLt;
+  const double n_2, logn; const int nmin1;
   MatrixXd JtDhatJ;
-  double ldLLt; // logdet(L*L')
-  double ldDiQ;  // logdet(inv(Diffs)*Q)
-  double ldLDLt;  // logdet(-L*Diffs*L')
-  double n_2, logn; int nmin1; // n/2, log(n), n-1
-  void initialize_diffs();
+  void initialize_sparse();
+  void refactor_between();
+  void refactor_within();
+  void update_within(const VectorXd &W);
+  bool lowrank_within(const VectorXd &W, MatrixXd &TinvPN, MatrixXd &PtTinv, double &ldM) const;
   void randpoint_in_habitat(MatrixXd &Seeds);
   void rnorm_effects(const double HalfInterval, const double rateS2, VectorXd &Effcts);
   
@@ -140,28 +195,37 @@ private:
   VectorXi nowmColors; // mapping that indicates which m tiles each vertex/deme falls into
   VectorXd nowW;    // the within demes component, one entry for each deme in the habitat
   MatrixXd nowBinv; // the between demes component, one entry for each pair of demes in the habitat (actually, its inverse)
+  MatrixXd nowB;    // the between demes component, B = inv(Binv), which does not change with the diversity rates
+
+  // Sparse Cholesky factorization of the Laplacian of the unobserved demes, which is computed in calc_between
+  // The symbolic analysis is done once, in initialize_sparse, and only the numeric factorization is repeated
+  mutable SimplicialLLT<SpMat> LuuLLT;
+  // The same factorization, but for the current migration rates, together with the (sparse) Luo block
+  // and z = inv(Luu)*1. These are necessary to update nowBinv when only a few edges change
+  SimplicialLLT<SpMat> nowLuuLLT;
+  SpMat nowLuo;
+  VectorXd nowLuuOnes;
+  // The inverse of T = B*C - W for the current B and W, together with inv(T)*1, log(abs(det(T)))
+  // and sum(inv(T) .* JtDobsJ*inv(C)). These are necessary to update the likelihood when only
+  // a few diversity rates change, see EEMS_wishpdfln_within
+  MatrixXd nowTinv;
+  VectorXd nowTinvOnes;
+  double nowldT, nowtrTinvE;
+
+  // The inverse temperature is 1 for the cold chain, which samples from the posterior
+  double invTemperature;
 
   // Fixed constants -- necessary to scale diploid and haploid species slightly differently
   double Wconst, Binvconst;
 
-  // Variables to store the results in :
-  // Fixed size:
-  MatrixXd mcmcmhyper;
-  MatrixXd mcmcqhyper;
-  MatrixXd mcmcthetas;
-  MatrixXd mcmcpilogl;
-  VectorXd mcmcmtiles;
-  VectorXd mcmcqtiles;  
-  // Variable length:
-  vector<double> mcmcmRates;
-  vector<double> mcmcqRates;
-  vector<double> mcmcxCoord;
-  vector<double> mcmcyCoord;
-  vector<double> mcmcwCoord;
-  vector<double> mcmczCoord;
+  // The saved iterations are streamed to mcmcpath by a background thread, see TraceWriter
+  boost::shared_ptr<TraceWriter> writer;
+  int niters; // the number of saved iterations
   
-  double EEMS_wishpdfln(const MatrixXd &Binv, const VectorXd &W, const double sigma2, const double df,
+  double EEMS_wishpdfln(const MatrixXd &B, const VectorXd &W, const double sigma2, const double df,
 			double &triDeltaQD, double &ll_atfixdf) const;
+  double EEMS_wishpdfln_within(const VectorXd &W, const double sigma2, const double df,
+			       double &triDeltaQD, double &ll_atfixdf) const;
   
 };
 
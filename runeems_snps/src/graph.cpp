@@ -101,11 +101,9 @@ void Graph::map_indiv_to_deme(const string &datapath, const int nIndiv) {
   check_condition(IndivCoord.rows() == nIndiv && IndivCoord.cols() == 2,
 		  "Check that " + datapath + ".coord is a list of locations, two coordinates per row.");
   cout << "  Loaded sample coordinates from " << datapath + ".coord" << endl;
-  indiv2deme.resize(nIndiv); // the deme to which each sample is assigned (to be determined)
-  for ( int i = 0, alpha = 0 ; i < nIndiv ; i++ ) {
-    pairwise_distance(DemeCoord,IndivCoord.row(i)).col(0).minCoeff( &alpha );
-    indiv2deme(i) = alpha;
-  }
+  // the deme to which each sample is assigned (to be determined)
+  SpatialIndex demeIndex(DemeCoord);
+  demeIndex.closest(IndivCoord,indiv2deme);
 }
 /*
   Assign new indices to the demes, so that
@@ -200,16 +198,63 @@ MatrixXd Graph::get_the_obsrv_demes() const
   return (DemeCoord.topLeftCorner(this->get_num_obsrv_demes(),2));
 }
 /*
-  Compute the pairwise distances of each deme in DemeCoord to each seed in Seeds.
-  Once EEMS is initialized, DemeCoord is fixed but Seeds changes as tiles are added and removed.
+  Find the closest seed in Seeds to each deme in DemeCoord.
+  Once EEMS is initialized, DemeCoord is fixed but Seeds changes as tiles are added and removed,
+  so the spatial index is built over the seeds rather than over the demes.
  */
 void Graph::index_closest_to_deme(const MatrixXd &Seeds, VectorXi &Closest) const
+{
+  SpatialIndex seedIndex(Seeds);
+  seedIndex.closest(DemeCoord,Closest);
+}
+/*
+  Update the mapping Closest after the seed Seeds.row(tile) has moved, or has been added
+  as the last row of Seeds. A deme that belongs to another tile either stays in its tile
+  or switches to the moved tile if it is now closer; only the demes that belonged to
+  the moved tile have to be compared to all seeds.
+ */
+void Graph::update_closest_to_deme(const MatrixXd &Seeds, const int tile, VectorXi &Closest) const
 {
   int nDemes = this->get_num_total_demes();
-  if (Closest.size()!=nDemes) { Closest.resize(nDemes); }
-  MatrixXd Dist = pairwise_distance(Seeds,DemeCoord);
+  vector<int> recolor;
+  MatrixXd Owners(nDemes,2);
+  for ( int i = 0 ; i < nDemes ; i++ ) {
+    if (Closest(i) == tile) { recolor.push_back(i); }
+    Owners.row(i) = Seeds.row(Closest(i));
+  }
+  VectorXd toOwner = rowwise_distance(Owners,DemeCoord);
+  VectorXd toTile = rowwise_distance(Seeds.row(tile).replicate(nDemes,1),DemeCoord);
   for ( int i = 0 ; i < nDemes ; i++ ) {
-    Dist.col(i).minCoeff( &Closest(i) );
+    if (toTile(i) < toOwner(i)) { Closest(i) = tile; }
+  }
+  recolor_closest_to_deme(Seeds,recolor,Closest);
+}
+/*
+  Update the mapping Closest after the seed in row tile has been removed with removeRow,
+  which copies the last seed into row tile. The demes in the removed tile have to be
+  compared to all seeds, and the demes in the last tile now belong to tile.
+ */
+void Graph::remove_closest_to_deme(const MatrixXd &Seeds, const int tile, VectorXi &Closest) const
+{
+  int nDemes = this->get_num_total_demes();
+  int last = Seeds.rows();
+  vector<int> recolor;
+  for ( int i = 0 ; i < nDemes ; i++ ) {
+    if (Closest(i) == tile) {
+      recolor.push_back(i);
+    } else if (Closest(i) == last) {
+      Closest(i) = tile;
+    }
+  }
+  recolor_closest_to_deme(Seeds,recolor,Closest);
+}
+// Find the closest seed to each deme in the list Demes
+void Graph::recolor_closest_to_deme(const MatrixXd &Seeds, const vector<int> &Demes, VectorXi &Closest) const
+{
+  if (Demes.empty()) { return; }
+  SpatialIndex seedIndex(Seeds);
+  for ( size_t i = 0 ; i < Demes.size() ; i++ ) {
+    Closest(Demes[i]) = seedIndex.closest(DemeCoord(Demes[i],0),DemeCoord(Demes[i],1));
   }
 }
 int Graph::neighbors_in_grid(const int r1, const int c1, int &r2, int &c2, const int pos,
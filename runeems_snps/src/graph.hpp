@@ -2,6 +2,7 @@
 
 #include "util.hpp"
 #include "habitat.hpp"
+#include "spatial.hpp"
 
 #include <boost/graph/adjacency_list.hpp>
 #include <boost/graph/connected_components.hpp>
@@ -31,6 +32,9 @@ public:
   int get_deme_of_indiv(const int i) const;
   void get_edge(int edge, int &alpha, int &beta) const;
   void index_closest_to_deme(const MatrixXd &X, VectorXi &Closest) const;
+  // Incremental versions of index_closest_to_deme, if only one seed has moved, been added or removed
+  void update_closest_to_deme(const MatrixXd &Seeds, const int tile, VectorXi &Closest) const;
+  void remove_closest_to_deme(const MatrixXd &Seeds, const int tile, VectorXi &Closest) const;
   MatrixXd get_the_obsrv_demes() const;
 
 private:
@@ -46,6 +50,7 @@ private:
   void make_triangular_grid(const Habitat &habitat, const int nDemeDensity);
   void map_indiv_to_deme(const string &datapath, const int nIndiv);
   void reindex_demes();
+  void recolor_closest_to_deme(const MatrixXd &Seeds, const vector<int> &Demes, VectorXi &Closest) const;
 
   // The grid to read does not need to be triangular as long as it is connected
   void read_input_grid(const string &datapath, MatrixXd &DemeCoord, MatrixXi &DemePairs);
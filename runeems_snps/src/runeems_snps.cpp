@@ -2,6 +2,8 @@
 #include "eems.hpp"
 
 #include <boost/config.hpp>
+#include <boost/thread.hpp>
+#include <boost/random/seed_seq.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/parsers.hpp>
 #include <boost/program_options/detail/config_file.hpp>
@@ -11,10 +13,180 @@ namespace po = boost::program_options;
 // Choose 'euclidean' (the default) or 'greatcirc' (great circle distance)
 string dist_metric;
 
+// Load the final state of a previous run, or draw a random initial state
+bool start_chain(EEMS &eems)
+{
+  boost::filesystem::path dir(eems.prevpath().c_str());
+  if (exists(dir)) {
+    cout << "Load final EEMS state from " << eems.prevpath() << endl << endl;
+    eems.load_final_state();
+  } else {
+    cout << "Initialize EEMS random state" << endl << endl;
+    eems.initialize_state();
+  }
+
+  if (!eems.start_eems( )) {
+    cerr << "[RunEEMS] Error starting EEMS." << endl;
+    return(false);
+  }
+  return(true);
+}
+
+// Propose and accept/reject one move, then do the Gibbs updates
+bool run_iteration(EEMS &eems, MCMC &mcmc, const Params &params, Proposal &proposal)
+{
+  switch ( eems.choose_move_type( ) ) {
+  case Q_VORONOI_BIRTH_DEATH:
+    eems.propose_birthdeath_qVoronoi(proposal);
+    break;
+  case M_VORONOI_BIRTH_DEATH:
+    eems.propose_birthdeath_mVoronoi(proposal);
+    break;
+  case Q_VORONOI_POINT_MOVE:
+    eems.propose_move_one_qtile(proposal);
+    break;
+  case M_VORONOI_POINT_MOVE:
+    eems.propose_move_one_mtile(proposal);
+    break;
+  case Q_VORONOI_RATE_UPDATE:
+    eems.propose_rate_one_qtile(proposal);
+    break;
+  case M_VORONOI_RATE_UPDATE:
+    eems.propose_rate_one_mtile(proposal);
+    break;
+  case M_MEAN_RATE_UPDATE:
+    eems.propose_overall_mrate(proposal);
+    break;
+  case DF_UPDATE:
+    eems.propose_df(proposal,mcmc);
+    break;
+  default:
+    cerr << "[RunEEMS] Unknown move type" << endl;
+    return(false);
+  }
+  
+  mcmc.add_to_total_moves(proposal.move);
+  if (eems.accept_proposal(proposal)) { mcmc.add_to_okay_moves(proposal.move); }
+  if (params.testing) { eems.check_ll_computation( ); }
+  
+  eems.update_sigma2( );
+  eems.update_hyperparams( );
+  mcmc.end_iteration( );
+  return(true);
+}
+
+// Run one MCMC chain to completion and save the results to the chain's mcmcpath
+bool run_chain(EEMS &eems, const Params &params)
+{
+  MCMC mcmc(params);
+  if (!start_chain(eems)) { return(false); }
+  
+  Proposal proposal;
+
+  while (!mcmc.finished) {
+    
+    if (!run_iteration(eems,mcmc,params,proposal)) { return(false); }
+    
+    // Check whether to save the current parameter state,
+    // as the thinned out iterations are not saved
+    if (mcmc.to_save_iteration()) {
+      eems.print_iteration(mcmc);
+      eems.save_iteration( );
+    }
+  }
+  
+  eems.output_results(mcmc);
+  return(true);
+}
+
+/*
+  Run params.nTempered copies of EEMS on separate threads (Metropolis-coupled MCMC).
+  Chain t samples from prior * likelihood^(1/(1+tempIncrement*t)), so chain 0 is the cold chain.
+  Every swapInterval iterations, the chains wait for each other and then propose to swap the states
+  of two adjacent chains, t and t+1, which is accepted with probability
+    min(1, exp((invT(t) - invT(t+1)) * (ll(t+1) - ll(t))))
+  Only the cold chain saves its draws to mcmcpath; the heated chains save their final state
+  to mcmcpath/heated2, mcmcpath/heated3, etc. so that a later run can resume from prevpath.
+ */
+bool run_tempered(const boost::shared_ptr<const EEMSData> &data, const Params &params)
+{
+  int nTempered = params.nTempered;
+  vector<Params> chainParams(nTempered,params);
+  vector<boost::shared_ptr<EEMS> > chains(nTempered);
+  vector<boost::shared_ptr<MCMC> > mcmcs(nTempered);
+  // The swap draws and the heated chains are seeded from a seed sequence, so that none of them
+  // repeats the random stream of the cold chain, which is seeded with params.seed
+  vector<boost::uint32_t> seeds(nTempered);
+  boost::random::seed_seq seedSeq{(boost::uint32_t)params.seed, (boost::uint32_t)nTempered};
+  seedSeq.generate(seeds.begin(),seeds.end());
+  for ( int t = 0 ; t < nTempered ; t++ ) {
+    if (seeds[t] == (boost::uint32_t)params.seed) { seeds[t]++; }
+  }
+  Draw swapDraw; swapDraw.initialize(seeds[0]);
+  for ( int t = 0 ; t < nTempered ; t++ ) {
+    if (t > 0) {
+      string chain = "/heated" + to_string(t+1);
+      chainParams[t].seed = seeds[t];
+      chainParams[t].mcmcpath = params.mcmcpath + chain;
+      boost::filesystem::create_directory(chainParams[t].mcmcpath);
+      if (!params.prevpath.empty()) {
+	chainParams[t].prevpath = params.prevpath + chain;
+	if (!boost::filesystem::exists(chainParams[t].prevpath)) { chainParams[t].prevpath.clear(); }
+      }
+    }
+    chains[t].reset(new EEMS(chainParams[t],data));
+    chains[t]->set_inverse_temperature(1.0/(1.0 + params.tempIncrement*t));
+    mcmcs[t].reset(new MCMC(chainParams[t]));
+    if (!start_chain(*chains[t])) { return(false); }
+  }
+
+  int okaySwaps = 0, totalSwaps = 0;
+  boost::barrier barrier(nTempered);
+  boost::thread_group threads;
+  for ( int t = 0 ; t < nTempered ; t++ ) {
+    threads.create_thread([&,t]() {
+	EEMS &eems = *chains[t];
+	MCMC &mcmc = *mcmcs[t];
+	Proposal proposal;
+	while (!mcmc.finished) {
+	  check_condition(run_iteration(eems,mcmc,chainParams[t],proposal), "Error in run_iteration");
+	  if (t == 0 && mcmc.to_save_iteration()) {
+	    eems.print_iteration(mcmc);
+	    eems.save_iteration( );
+	  }
+	  // All chains reach this point at the same iteration; the first chain proposes the swap
+	  // while the other chains wait
+	  if (mcmc.currIter % params.swapInterval == 0) {
+	    barrier.wait();
+	    if (t == 0) {
+	      int s = swapDraw.runif_int(0,nTempered-2);
+	      EEMS &cooler = *chains[s], &hotter = *chains[s+1];
+	      double ratioln = (cooler.get_inverse_temperature() - hotter.get_inverse_temperature()) *
+		(hotter.get_log_likelihood() - cooler.get_log_likelihood());
+	      totalSwaps++;
+	      if (log(swapDraw.runif()) < min(0.0,ratioln)) {
+		cooler.swap_state(hotter);
+		okaySwaps++;
+	      }
+	    }
+	    barrier.wait();
+	  }
+	}
+      });
+  }
+  threads.join_all();
+
+  cout << "Accepted " << okaySwaps << " out of " << totalSwaps << " proposals to swap chains" << endl;
+  for ( int t = 1 ; t < nTempered ; t++ ) { chains[t]->output_current_state(); }
+  chains[0]->output_results(*mcmcs[0]);
+  return(true);
+}
+
 int main(int argc, char** argv)
 {
   // random seed
   long seed = time(NULL);
+  int nChains = 1;
   string config_file;
   Params params;
 
@@ -33,6 +205,14 @@ int main(int argc, char** argv)
     eems_options.add_options()
       ("seed", po::value<long>(&seed),
        "Set the random seed")
+      ("nTempered", po::value<int>(&params.nTempered)->default_value(1),
+       "Number of Metropolis-coupled chains (one cold chain and nTempered-1 heated chains) on separate threads.")
+      ("tempIncrement", po::value<double>(&params.tempIncrement)->default_value(0.1),
+       "Heat increment: the t-th heated chain samples from prior * likelihood^(1/(1+tempIncrement*t)).")
+      ("swapInterval", po::value<int>(&params.swapInterval)->default_value(100),
+       "Number of iterations between proposals to swap the states of two tempered chains.")
+      ("nChains", po::value<int>(&nChains)->default_value(1),
+       "Number of chains to run on separate threads, with output to mcmcpath/chain1, mcmcpath/chain2, etc.")
       ("datapath", po::value<string>(&params.datapath),
        "Full path to a set of three files: datapath.coord, datapath.diffs and datapath.outer.")
       ("mcmcpath", po::value<string>(&params.mcmcpath),
@@ -53,6 +233,8 @@ int main(int argc, char** argv)
        "Logical. Indicates whether the species is diploid (true) or haploid (false).")
       ("distance", po::value<string>(&dist_metric)->default_value("euclidean"),
        "Distance metric. Either 'euclidean' or 'greatcirc', i.e., great circle.")
+      ("outputFormat", po::value<string>(&params.outputFormat)->default_value("text"),
+       "Format of the MCMC trace files. Either 'text' (mcmc*.txt) or 'binary' (mcmc*.bin).")
       ("numMCMCIter", po::value<int>(&params.numMCMCIter),
        "Number of Markov Chain Monte Carlo iterations.")
       ("numBurnIter", po::value<int>(&params.numBurnIter),
@@ -112,75 +294,45 @@ int main(int argc, char** argv)
 
     params.seed = seed;
     params.check_input_arguments();
+    check_condition(nChains > 0, "Check that nChains > 0");
     
-    EEMS eems(params);
-    MCMC mcmc(params);
-    
-    boost::filesystem::path dir(eems.prevpath().c_str());
-    if (exists(dir)) {
-      cout << "Load final EEMS state from " << eems.prevpath() << endl << endl;
-      eems.load_final_state();
+    if (nChains == 1 && params.nTempered == 1) {
+      EEMS eems(params);
+      if (!run_chain(eems,params)) { return(EXIT_FAILURE); }
+    } else if (nChains == 1) {
+      boost::shared_ptr<const EEMSData> data(new EEMSData(params));
+      if (!run_tempered(data,params)) { return(EXIT_FAILURE); }
     } else {
-      cout << "Initialize EEMS random state" << endl << endl;
-      eems.initialize_state();
-    }
-  
-    if (!eems.start_eems(mcmc)) {
-      cerr << "[RunEEMS] Error starting EEMS." << endl;
-      return(EXIT_FAILURE);
-    }
-  
-    Proposal proposal;
-
-    while (!mcmc.finished) {
-      
-      switch ( eems.choose_move_type( ) ) {
-      case Q_VORONOI_BIRTH_DEATH:
-	eems.propose_birthdeath_qVoronoi(proposal);
-	break;
-      case M_VORONOI_BIRTH_DEATH:
-	eems.propose_birthdeath_mVoronoi(proposal);
-	break;
-      case Q_VORONOI_POINT_MOVE:
-	eems.propose_move_one_qtile(proposal);
-	break;
-      case M_VORONOI_POINT_MOVE:
-	eems.propose_move_one_mtile(proposal);
-	break;
-      case Q_VORONOI_RATE_UPDATE:
-	eems.propose_rate_one_qtile(proposal);
-	break;
-      case M_VORONOI_RATE_UPDATE:
-	eems.propose_rate_one_mtile(proposal);
-	break;
-      case M_MEAN_RATE_UPDATE:
-	eems.propose_overall_mrate(proposal);
-	break;
-      case DF_UPDATE:
-	eems.propose_df(proposal,mcmc);
-	break;
-      default:
-	cerr << "[RunEEMS] Unknown move type" << endl;
-	return(EXIT_FAILURE);
+      // The chains share the data but each chain has its own random seed and output directory
+      boost::shared_ptr<const EEMSData> data(new EEMSData(params));
+      vector<Params> chainParams(nChains,params);
+      vector<int> status(nChains,0);
+      for ( int k = 0 ; k < nChains ; k++ ) {
+	string chain = "/chain" + to_string(k+1);
+	chainParams[k].seed = seed + k;
+	chainParams[k].mcmcpath = params.mcmcpath + chain;
+	boost::filesystem::create_directory(chainParams[k].mcmcpath);
+	if (!params.prevpath.empty()) {
+	  chainParams[k].prevpath = params.prevpath + chain;
+	  if (!boost::filesystem::exists(chainParams[k].prevpath)) { chainParams[k].prevpath.clear(); }
+	}
+      }
+      boost::thread_group threads;
+      for ( int k = 0 ; k < nChains ; k++ ) {
+	threads.create_thread([&data,&chainParams,&status,k]() {
+	    if (chainParams[k].nTempered > 1) {
+	      status[k] = run_tempered(data,chainParams[k]);
+	    } else {
+	      EEMS eems(chainParams[k],data);
+	      status[k] = run_chain(eems,chainParams[k]);
+	    }
+	  });
+      }
+      threads.join_all();
+      for ( int k = 0 ; k < nChains ; k++ ) {
+	if (!status[k]) { return(EXIT_FAILURE); }
       }
-	
-      mcmc.add_to_total_moves(proposal.move);
-      if (eems.accept_proposal(proposal)) { mcmc.add_to_okay_moves(proposal.move); }
-      if (params.testing) { eems.check_ll_computation( ); }
-      
-      eems.update_sigma2( );
-      eems.update_hyperparams( );
-      mcmc.end_iteration( );
-      
-      // Check whether to save the current parameter state,
-      // as the thinned out iterations are not saved
-      if (mcmc.to_save_iteration()) {
-	eems.print_iteration(mcmc);
-	eems.save_iteration(mcmc);
-      }      
     }
-    
-    eems.output_results(mcmc);
         
   } catch(exception& e) {
     cerr << e.what() << endl;
@@ -0,0 +1,78 @@
+
+#include "spatial.hpp"
+
+extern string dist_metric;
+
+SpatialIndex::SpatialIndex( ) : dim(2) { }
+SpatialIndex::SpatialIndex(const MatrixXd &Points) { build(Points); }
+SpatialIndex::~SpatialIndex( ) { }
+void SpatialIndex::build(const MatrixXd &Points) {
+  check_condition(Points.cols() == 2, "SpatialIndex : ncol(Points) != 2");
+  int n = Points.rows();
+  dim = (!dist_metric.compare("greatcirc")) ? 3 : 2;
+  Coord.resize(3,n);
+  for ( int i = 0 ; i < n ; i++ ) {
+    Coord.col(i) = to_search_coord(Points(i,0),Points(i,1));
+  }
+  Nodes.resize(n);
+  for ( int i = 0 ; i < n ; i++ ) { Nodes[i] = i; }
+  build_tree(0,n,0);
+}
+int SpatialIndex::get_num_points( ) const { return (Nodes.size()); }
+Vector3d SpatialIndex::to_search_coord(const double x, const double y) const {
+  Vector3d q;
+  if (dim == 3) {
+    // Convert (longitude, latitude) from degrees to a point on the unit sphere
+    double degree = boost::math::double_constants::degree;
+    double lon = x * degree, lat = y * degree;
+    q << cos(lat) * cos(lon), cos(lat) * sin(lon), sin(lat);
+  } else {
+    q << x, y, 0.0;
+  }
+  return (q);
+}
+// Place the median location along dimension depth%dim in the middle of [lo,hi),
+// with the smaller coordinates before it and the larger coordinates after it
+void SpatialIndex::build_tree(const int lo, const int hi, const int depth) {
+  if (hi - lo < 2) { return; }
+  int mid = (lo + hi) / 2;
+  int axis = depth % dim;
+  nth_element(Nodes.begin() + lo, Nodes.begin() + mid, Nodes.begin() + hi,
+	      [this,axis](int a, int b) { return (Coord(axis,a) < Coord(axis,b)); });
+  build_tree(lo,mid,depth+1);
+  build_tree(mid+1,hi,depth+1);
+}
+void SpatialIndex::search_tree(const Vector3d &q, const int lo, const int hi, const int depth,
+			       int &best, double &bestDist) const {
+  if (hi <= lo) { return; }
+  int mid = (lo + hi) / 2;
+  int axis = depth % dim;
+  int node = Nodes[mid];
+  double dist = (Coord.col(node) - q).squaredNorm();
+  if ((dist < bestDist) || (dist == bestDist && node < best)) {
+    best = node; bestDist = dist;
+  }
+  double diff = q(axis) - Coord(axis,node);
+  // Search the side of the split that contains the query point first, and the other side
+  // only if the splitting plane is not farther than the closest location found so far
+  if (diff < 0.0) {
+    search_tree(q,lo,mid,depth+1,best,bestDist);
+    if (diff*diff <= bestDist) { search_tree(q,mid+1,hi,depth+1,best,bestDist); }
+  } else {
+    search_tree(q,mid+1,hi,depth+1,best,bestDist);
+    if (diff*diff <= bestDist) { search_tree(q,lo,mid,depth+1,best,bestDist); }
+  }
+}
+int SpatialIndex::closest(const double x, const double y) const {
+  int best = -1;
+  double bestDist = Inf;
+  search_tree(to_search_coord(x,y),0,Nodes.size(),0,best,bestDist);
+  return (best);
+}
+void SpatialIndex::closest(const MatrixXd &X, VectorXi &Closest) const {
+  int n = X.rows();
+  if (Closest.size()!=n) { Closest.resize(n); }
+  for ( int i = 0 ; i < n ; i++ ) {
+    Closest(i) = closest(X(i,0),X(i,1));
+  }
+}
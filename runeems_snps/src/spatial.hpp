@@ -0,0 +1,51 @@
+#pragma once
+
+#include "util.hpp"
+
+#include <algorithm>
+
+#ifndef SPATIAL_H
+#define SPATIAL_H
+
+/*
+  A k-d tree over a fixed set of locations (one location per row, with two coordinates),
+  to find the closest location to a query point without computing all pairwise distances.
+  With the Euclidean metric, the tree is built on the coordinates as they are.
+  With the great circle metric, the (longitude, latitude) pairs are mapped to points on the
+  unit sphere, since the chord between two points increases with the great circle distance.
+ */
+
+class SpatialIndex {
+public:
+
+  SpatialIndex( );
+  SpatialIndex(const MatrixXd &Points);
+  ~SpatialIndex( );
+
+  void build(const MatrixXd &Points);
+  int get_num_points( ) const;
+  // The index of the closest location to (x,y); ties are broken in favor of the smaller index,
+  // as in pairwise_distance(Points,Y).col(0).minCoeff( &closest )
+  int closest(const double x, const double y) const;
+  // The index of the closest location to each row of X
+  void closest(const MatrixXd &X, VectorXi &Closest) const;
+
+private:
+
+  // Coord: the locations in search coordinates (one location per column), which are
+  // fixed-size 3-vectors so that no memory is allocated per point; the third coordinate is 0
+  // unless dim = 3
+  // Nodes: the permutation of the locations that stores the tree, where the node that
+  // covers the range [lo,hi) is the location Nodes[(lo+hi)/2] and splits along dimension depth%dim
+  Matrix3Xd Coord;
+  vector<int> Nodes;
+  int dim;
+
+  Vector3d to_search_coord(const double x, const double y) const;
+  void build_tree(const int lo, const int hi, const int depth);
+  void search_tree(const Vector3d &q, const int lo, const int hi, const int depth,
+		   int &best, double &bestDist) const;
+
+};
+
+#endif
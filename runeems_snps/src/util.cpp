@@ -10,6 +10,7 @@ Params::Params( ) {
   mcmcpath = "";
   prevpath = "";
   gridpath = "";
+  outputFormat = "text";
   nDemes = 0;
   nIndiv = 0;
   nSites = 0;
@@ -33,6 +34,9 @@ Params::Params( ) {
   mEffctHalfInterval = 2.0;
   qEffctHalfInterval = 0.1;
   mrateMuHalfInterval = 2.4771; // log10(300)
+  nTempered = 1;
+  swapInterval = 100;
+  tempIncrement = 0.1;
   /*
     There are two functions for testing whether the prior and the likelihood are computed correctly:
     * test_prior(parameters) + test_likelihood(parameters)
@@ -70,6 +74,11 @@ void Params::check_input_arguments() {
   check_condition(negBiSize > 0, "Check that negBiSize > 0");
   check_condition(negBiProb > 0.0 && negBiProb < 1.0,
 		  "Check that negBiProb in (0,1)");
+  check_condition(!outputFormat.compare("text") || !outputFormat.compare("binary"),
+		  "Check that 'outputFormat' is either 'text' or 'binary'");
+  check_condition(nTempered > 0, "Check that nTempered > 0");
+  check_condition(swapInterval > 0, "Check that swapInterval > 0");
+  check_condition(tempIncrement > 0.0, "Check that tempIncrement > 0");
   check_condition(dist_metric.compare("euclidean") || dist_metric.compare("greatcirc"),
 		  "Check that 'distance' is either 'euclidean' or 'greatcirc'");
   /////////////////////////////////////////////////////
@@ -89,8 +98,9 @@ void Params::check_input_arguments() {
   check_condition(numeric_limits<double>::has_infinity, "No representation for infinity");
   check_condition(boost::filesystem::exists(datapath + ".coord"),
 		  "Check that " + datapath + ".coord exists");
-  check_condition(boost::filesystem::exists(datapath + ".diffs"),
-		  "Check that " + datapath + ".diffs exists");
+  check_condition(boost::filesystem::exists(datapath + ".diffs") ||
+		  boost::filesystem::exists(datapath + ".diffs.bin"),
+		  "Check that " + datapath + ".diffs (or " + datapath + ".diffs.bin) exists");
   check_condition(boost::filesystem::exists(datapath + ".outer"),
 		  "Check that " + datapath + ".outer exists");
   if ( !gridpath.empty() ) {
@@ -119,6 +129,7 @@ ostream& operator<<(ostream& out, const Params& params) {
       << "               prevpath = " << params.prevpath << endl
       << "               gridpath = " << params.gridpath << endl    
       << "               distance = " << dist_metric << endl
+      << "           outputFormat = " << params.outputFormat << endl
       << "                diploid = " << params.diploid << endl
       << "                 nIndiv = " << params.nIndiv << endl
       << "                 nSites = " << params.nSites << endl
@@ -127,6 +138,8 @@ ostream& operator<<(ostream& out, const Params& params) {
       << "            numMCMCIter = " << params.numMCMCIter << endl
       << "            numBurnIter = " << params.numBurnIter << endl
       << "            numThinIter = " << params.numThinIter << endl
+      << "              nTempered = " << params.nTempered << endl
+      << "           swapInterval = " << params.swapInterval << endl
       << "              negBiSize = " << params.negBiSize << endl
       << fixed << setprecision(6)
       << "              negBiProb = " << params.negBiProb << endl
@@ -141,7 +154,8 @@ ostream& operator<<(ostream& out, const Params& params) {
       << "       qSeedsProposalS2 = " << params.qSeedsProposalS2 << endl
       << "       mEffctProposalS2 = " << params.mEffctProposalS2 << endl
       << "       qEffctProposalS2 = " << params.qEffctProposalS2 << endl
-      << "      mrateMuProposalS2 = " << params.mrateMuProposalS2 << endl;
+      << "      mrateMuProposalS2 = " << params.mrateMuProposalS2 << endl
+      << "          tempIncrement = " << params.tempIncrement << endl;
   return out;
 }
 VectorXd split(const string &line) {
@@ -297,6 +311,22 @@ MatrixXd pairwise_distance(const MatrixXd &X, const MatrixXd &Y) {
     return (euclidean_dist(X,Y));
   }
 }
+// Compute the distance between the i-th row of X and the i-th row of Y, for every row i.
+// Choose either Euclidean or great circle distance, as in pairwise_distance
+VectorXd rowwise_distance(const MatrixXd &X, const MatrixXd &Y) {
+  check_condition(X.rows() == Y.rows() && X.cols() == 2 && Y.cols() == 2,
+		  "rowwise_distance : size(X) != size(Y) or ncol(X) != 2");
+  if (!dist_metric.compare("greatcirc")) {
+    double degree = boost::math::double_constants::degree;
+    ArrayXd lon1 = X.col(0).array() * degree, lat1 = X.col(1).array() * degree;
+    ArrayXd lon2 = Y.col(0).array() * degree, lat2 = Y.col(1).array() * degree;
+    ArrayXd h = 0.5 * (1.0 - (lat2 - lat1).cos()) + 0.5 * (1.0 - (lon2 - lon1).cos()) * lat1.cos() * lat2.cos();
+    VectorXd d = (h < 1.0).select(h.sqrt(), 1.0).asin();
+    return (Earth_radiusX2 * d);
+  } else {
+    return ((X - Y).rowwise().squaredNorm());
+  }
+}
 MatrixXd resistance_distance(const MatrixXd &M) {
   check_condition(M.cols() == M.rows(), "resistance distance : M is not symmetric");
   check_condition(M.minCoeff() >= 0, "resistance distance : M has negative weights");
@@ -322,47 +352,150 @@ MatrixXd expected_dissimilarities(const MatrixXd &J, const MatrixXd &M, const Ve
   Delta.diagonal() -= Jw;
   return Delta;
 }
-// Read a matrix, with unknown dimensions, from a text file
-// Return an empty matrix (0 rows, 0 columns) if there is an error
+/*
+  Parse a decimal number (an optional sign, digits with an optional decimal point and an optional
+  exponent) that starts at pos, directly from the mapped file and independently of the locale.
+  Up to 19 significant digits are collected into an integer; if it and the power of ten are both
+  exactly representable as doubles, a single multiplication or division gives the correctly rounded
+  result, as strtod would. The other (rare) numbers are converted by a stream in the "C" locale.
+  Returns false if there is no number at pos. Afterwards pos points just after the number
+ */
+static bool parse_number(const char *&pos, const char *end, double &number) {
+  static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+				    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+  const char *start = pos;
+  bool negative = false;
+  if (pos < end && (*pos == '-' || *pos == '+')) { negative = (*pos == '-'); pos++; }
+  const char *unsigned_start = pos;
+  uint64_t mantissa = 0;
+  int digits = 0, exponent = 0;
+  bool exact = true, seen = false;
+  for (bool point = false ; pos < end ; pos++) {
+    if (*pos == '.' && !point) { point = true; continue; }
+    if (*pos < '0' || *pos > '9') { break; }
+    seen = true;
+    if (mantissa || *pos != '0') { digits++; }
+    if (digits <= 19) {
+      mantissa = 10 * mantissa + (*pos - '0');
+      if (point) { exponent--; }
+    } else {
+      // Further digits are dropped, so the fast path below does not apply
+      if (*pos != '0') { exact = false; }
+      if (!point) { exponent++; }
+    }
+  }
+  if (!seen) { pos = start; return false; }
+  if (pos < end && (*pos == 'e' || *pos == 'E')) {
+    pos++;
+    bool negexp = false;
+    if (pos < end && (*pos == '-' || *pos == '+')) { negexp = (*pos == '-'); pos++; }
+    if (pos == end || *pos < '0' || *pos > '9') { pos = start; return false; }
+    int e = 0;
+    for ( ; pos < end && *pos >= '0' && *pos <= '9' ; pos++) { if (e < 100000) { e = 10 * e + (*pos - '0'); } }
+    exponent += negexp ? -e : e;
+  }
+  if (exact && mantissa < (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+    number = (double)mantissa;
+    number = (exponent < 0) ? number / powers[-exponent] : number * powers[exponent];
+  } else {
+    istringstream in(string(unsigned_start, pos));
+    in.imbue(locale::classic());
+    in >> number;
+    if (in.fail()) { pos = start; return false; }
+  }
+  if (negative) { number = -number; }
+  return true;
+}
+// Parse one line of whitespace-separated numbers, starting at pos, into row.
+// Returns false if the line contains anything other than numbers. Afterwards pos points to the next line
+static bool parse_line(const char *&pos, const char *end, vector<double> &row) {
+  row.clear();
+  const char *eol = static_cast<const char*>(memchr(pos, '\n', end - pos));
+  if (!eol) { eol = end; }
+  bool valid = true;
+  while (pos < eol) {
+    while (pos < eol && isspace((unsigned char)*pos)) { pos++; }
+    if (pos == eol) { break; }
+    double number;
+    if (!parse_number(pos, eol, number) || (pos < eol && !isspace((unsigned char)*pos))) { valid = false; break; }
+    row.push_back(number);
+  }
+  pos = (eol < end) ? eol + 1 : end;
+  return valid;
+}
+/*
+  Read a matrix of numbers, with unknown dimensions, one row per line. The file is mapped into memory
+  and read once: the first line determines the number of columns and the number of lines determines
+  the number of rows, so the matrix is allocated only once. Returns an empty matrix (0 rows, 0 columns)
+  if the file cannot be opened or if the rows are not all of the same length.
+ */
 MatrixXd readMatrixXd(const string &filename) {
-  ifstream instrm(filename.c_str(), ios::in);
-  if (!instrm.is_open( )) { return (MatrixXd::Zero(0,0)); }
-  string line; getline(instrm,line);
-  boost::algorithm::trim(line);
+  boost::iostreams::mapped_file_source file;
+  try {
+    file.open(filename);
+  } catch (exception &e) {
+    return (MatrixXd::Zero(0,0));
+  }
+  if (!file.is_open() || !file.size()) { return (MatrixXd::Zero(0,0)); }
+  const char *pos = file.data(), *end = file.data() + file.size();
+  int rows = count(pos, end, '\n');
+  if (end[-1] != '\n') { rows++; }
+  vector<double> row;
   // Split the first line into numbers
-  VectorXd row = split(line);
   // This tells us the number of columns
+  if (!parse_line(pos,end,row) || row.empty()) { return (MatrixXd::Zero(0,0)); }
   int cols = row.size();
-  if (!cols) { return (MatrixXd::Zero(0,0)); }
-  MatrixXd mat(1,cols); mat.row(0) = row;
-  while (getline(instrm,line)) {
-    boost::algorithm::trim(line);
-    row = split(line);
-    if (row.size()==cols) {
-      // Resize the matrix to add each row (done once at the start)
-      insertRow(mat,row);
-    } else {
-      return (MatrixXd::Zero(0,0));
-    }
+  MatrixXd mat(rows,cols);
+  mat.row(0) = RowVectorXd::Map(&row[0],cols);
+  for ( int i = 1 ; i < rows ; i++ ) {
+    if (!parse_line(pos,end,row) || (int)row.size() != cols) { return (MatrixXd::Zero(0,0)); }
+    mat.row(i) = RowVectorXd::Map(&row[0],cols);
   }
-  instrm.close();
-  return mat;
+  return (mat);
 }
-// If there are two draws and the first has two tiles and the second -- three tiles,
-// then sizes = c(2,3) and array = c(m_{1t_1},m_{1t_2},m_{2t_1},m_{2t_2},m_{2t_3})
-void dlmcell(const string &filename, const VectorXd &sizes, const vector<double> &array) {
-  check_condition(array.size() == sizes.sum(), "dlmcell : length(array) != sum(sizes).");
-  ofstream out(filename.c_str(),ofstream::out);
-  check_condition(out.is_open(), "Cannot open " + filename + " for writing");
-  vector<double>::const_iterator it = array.begin();
-  for ( int i = 0 ; i < sizes.size() ; i++ ) {
-    for ( int j = 0 ; j < sizes(i) ; j++ ) {
-      out << fixed << setprecision(6) << *it << " "; it++;
-      check_condition(!out.bad(), "Failed writing to " + filename);
-    }
-    out << endl;
+/*
+  Read a dissimilarity matrix in the binary format written by bed2diffs --binary:
+  the 8-byte tag "EEMSDIF1", the number of samples and the number of SNPs as 64-bit integers,
+  followed by the upper triangle (i < j, row by row) as little-endian 64-bit doubles.
+  The file is mapped into memory and copied into both triangles of the full matrix.
+  Returns an empty matrix if the file cannot be opened or is not in this format, and
+  warns if the number of SNPs in the file is not the expected number, nSites.
+ */
+MatrixXd readPackedDiffs(const string &filename, const int nSites) {
+  const int one = 1;
+  check_condition(*(const char*)&one == 1, "The binary diffs format requires a little-endian machine");
+  boost::iostreams::mapped_file_source file;
+  try {
+    file.open(filename);
+  } catch (exception &e) {
+    return (MatrixXd::Zero(0,0));
   }
-  out.close( );
+  const size_t header = 8 + 2 * sizeof(int64_t);
+  if (!file.is_open() || file.size() < header || memcmp(file.data(), "EEMSDIF1", 8)) {
+    return (MatrixXd::Zero(0,0));
+  }
+  int64_t nIndiv, nSitesFile;
+  memcpy(&nIndiv, file.data() + 8, sizeof(int64_t));
+  memcpy(&nSitesFile, file.data() + 8 + sizeof(int64_t), sizeof(int64_t));
+  const size_t nPairs = nIndiv * (nIndiv - 1) / 2;
+  if (nIndiv < 2 || file.size() != header + nPairs * sizeof(double)) {
+    return (MatrixXd::Zero(0,0));
+  }
+  cout << "  Read the dissimilarities between " << nIndiv << " samples, averaged across "
+       << nSitesFile << " SNPs, from " << filename << endl;
+  if (nSitesFile != nSites) {
+    cout << "  Warning: " << filename << " was computed from " << nSitesFile
+	 << " SNPs, but nSites = " << nSites << endl;
+  }
+  const char *packed = file.data() + header;
+  MatrixXd mat = MatrixXd::Zero(nIndiv,nIndiv);
+  for ( int i = 0 ; i < nIndiv - 1 ; i++ ) {
+    // The upper triangle is stored row by row, which is the lower triangle stored column by column
+    const int len = nIndiv - i - 1;
+    memcpy(mat.col(i).data() + i + 1, packed, len * sizeof(double));
+    packed += len * sizeof(double);
+  }
+  return (mat.selfadjointView<Lower>());
 }
 void dlmwrite(const string &filename, const MatrixXd & mat) {
   ofstream out(filename.c_str(),ofstream::out);
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+#include <algorithm>
 #include <vector>
 #include <limits>
 #include <iomanip>
@@ -20,6 +24,7 @@ using namespace Eigen;
 #include <boost/math/distributions/normal.hpp>
 #include <boost/numeric/conversion/bounds.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 
 #ifndef UTIL_H
 #define UTIL_H
@@ -45,6 +50,7 @@ public:
   long seed;
   bool diploid, testing;
   string datapath, mcmcpath, prevpath, gridpath;
+  string outputFormat; // the format of the MCMC trace files, either 'text' (the default) or 'binary'
   double qEffctHalfInterval, mEffctHalfInterval, mrateMuHalfInterval;
   double mSeedsProposalS2, mSeedsProposalS2x, mSeedsProposalS2y;
   double qSeedsProposalS2, qSeedsProposalS2x, qSeedsProposalS2y;
@@ -56,6 +62,11 @@ public:
   double dfmin, dfmax, qVoronoiPr;
   int numMCMCIter, numBurnIter, numThinIter;
   int nDemes, nIndiv, nSites, negBiSize;
+  // Parallel tempering: the number of chains (one cold and nTempered-1 heated),
+  // the heat increment (chain t has inverse temperature 1/(1+tempIncrement*t)),
+  // and the number of iterations between attempts to swap the states of two chains
+  int nTempered, swapInterval;
+  double tempIncrement;
 };
 
 VectorXd split(const string &line);
@@ -68,11 +79,12 @@ double pseudowishpdfln(const MatrixXd &X, const MatrixXd &Sigma, const int df);
 double mvgammaln(const double a, const int p);
 double wishpdfln(const MatrixXd &X, const MatrixXd &Sigma, const double df);
 MatrixXd pairwise_distance(const MatrixXd &X, const MatrixXd &Y);
+VectorXd rowwise_distance(const MatrixXd &X, const MatrixXd &Y);
 MatrixXd resistance_distance(const MatrixXd& M, const int o);
 MatrixXd expected_dissimilarities(const MatrixXd &J, const MatrixXd& M, const VectorXd& W);
 MatrixXd readMatrixXd(const string &filename);
+MatrixXd readPackedDiffs(const string &filename, const int nSites);
 void dlmwrite(const string &filename, const MatrixXd & mat);
-void dlmcell(const string &filename, const VectorXd &sizes, const vector<double> &array);
 void removeRow(MatrixXd &matrix, const int rowToRemove);
 void removeElem(VectorXd &vector, const int elemToRemove);
 void insertRow(MatrixXd &mat, const VectorXd &row);
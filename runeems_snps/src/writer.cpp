@@ -0,0 +1,148 @@
+
+#include "writer.hpp"
+
+static const char *trace_files[] = {
+  "mcmcthetas.txt", "mcmcqhyper.txt", "mcmcmhyper.txt", "mcmcpilogl.txt", "mcmcqtiles.txt", "mcmcmtiles.txt",
+  "mcmcqrates.txt", "mcmcwcoord.txt", "mcmczcoord.txt", "mcmcmrates.txt", "mcmcxcoord.txt", "mcmcycoord.txt"
+};
+// The number of values per row in each file, where 0 means one value per tile
+static const int trace_ncols[] = { 2, 2, 2, 2, 1, 1, 0, 0, 0, 0, 0, 0 };
+static const int num_trace_files = 12;
+static const int num_summary_files = 6;
+
+TraceWriter::TraceWriter(const string &mcmcpath, const bool binary, const int chunkSize, const int maxChunks) :
+  mcmcpath(mcmcpath), binary(binary), chunkSize(chunkSize), maxChunks(maxChunks), done(false), opened(false)
+{
+  if (binary) {
+    const int one = 1;
+    check_condition(*(const char*)&one == 1, "The binary output format requires a little-endian machine");
+  }
+  chunk.reserve(chunkSize);
+  thread = boost::thread(&TraceWriter::run, this);
+}
+TraceWriter::~TraceWriter( ) {
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    done = true;
+  }
+  changed.notify_all();
+  if (thread.joinable()) { thread.join(); }
+}
+void TraceWriter::push(const SavedIteration &iteration) {
+  chunk.push_back(iteration);
+  if ((int)chunk.size() < chunkSize) { return; }
+  boost::mutex::scoped_lock lock(mutex);
+  // Wait for the background thread if it has fallen behind, to keep the memory bounded
+  while ((int)queue.size() >= maxChunks) { changed.wait(lock); }
+  queue.push_back(Chunk());
+  queue.back().swap(chunk);
+  chunk.reserve(chunkSize);
+  changed.notify_all();
+}
+void TraceWriter::close( ) {
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    if (!chunk.empty()) {
+      queue.push_back(Chunk());
+      queue.back().swap(chunk);
+    }
+    done = true;
+  }
+  changed.notify_all();
+  if (thread.joinable()) { thread.join(); }
+  // Create the output files even if no iterations were saved
+  if (!opened) { open_files(); }
+  for ( size_t i = 0 ; i < files.size() ; i++ ) { files[i]->close(); }
+  if (binary) { return; }
+  // Rewrite the summary files with the column padding of dlmwrite
+  for ( int i = 0 ; i < num_summary_files ; i++ ) {
+    const int ncols = trace_ncols[i], nrows = summaries[i].size() / ncols;
+    Map<const Matrix<double,Dynamic,Dynamic,RowMajor> > values(summaries[i].data(),nrows,ncols);
+    dlmwrite(mcmcpath + "/" + trace_files[i], values);
+  }
+}
+void TraceWriter::run( ) {
+  Chunk next;
+  while (true) {
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      while (queue.empty() && !done) { changed.wait(lock); }
+      if (queue.empty()) { return; }
+      next.swap(queue.front());
+      queue.pop_front();
+    }
+    changed.notify_all();
+    write_chunk(next);
+    next.clear();
+  }
+}
+// The output files are opened when the first chunk is written, so that a chain which
+// does not save any draws (such as a heated chain) does not overwrite existing files
+void TraceWriter::open_files( ) {
+  for ( int i = 0 ; i < num_trace_files ; i++ ) {
+    string filename = mcmcpath + "/" + trace_files[i];
+    if (binary) { filename.replace(filename.size()-4,4,".bin"); }
+    ios_base::openmode mode = binary ? (ofstream::out | ofstream::binary) : ofstream::out;
+    files.push_back(boost::shared_ptr<ofstream>(new ofstream(filename.c_str(),mode)));
+    check_condition(files.back()->is_open(), "Cannot open " + filename + " for writing");
+    if (binary) {
+      const int header[2] = { trace_ncols[i], 0 };
+      files.back()->write("EEMSTRC1",8);
+      files.back()->write((const char*)header,sizeof(header));
+    } else {
+      *files.back() << fixed << setprecision(6);
+    }
+  }
+  opened = true;
+}
+static void write_cell(ofstream &out, const VectorXd &values) {
+  for ( int j = 0 ; j < values.size() ; j++ ) { out << values(j) << " "; }
+  out << "\n";
+}
+static void write_binary(ofstream &out, const double *values, const int size) {
+  out.write((const char*)values,size*sizeof(double));
+}
+static void write_binary(ofstream &out, const double a, const double b) {
+  const double values[2] = { a, b };
+  write_binary(out,values,2);
+}
+void TraceWriter::write_chunk(const Chunk &chunk) {
+  if (!opened) { open_files(); }
+  for ( size_t i = 0 ; i < chunk.size() ; i++ ) {
+    const SavedIteration &it = chunk[i];
+    if (binary) {
+      write_binary(*files[0],it.sigma2,it.df);
+      write_binary(*files[1],0.0,it.qrateS2);
+      write_binary(*files[2],it.mrateMu,it.mrateS2);
+      write_binary(*files[3],it.pi,it.ll);
+      const double qtiles = it.qRates.size(), mtiles = it.mRates.size();
+      write_binary(*files[4],&qtiles,1);
+      write_binary(*files[5],&mtiles,1);
+      write_binary(*files[6],it.qRates.data(),it.qRates.size());
+      write_binary(*files[7],it.wCoord.data(),it.wCoord.size());
+      write_binary(*files[8],it.zCoord.data(),it.zCoord.size());
+      write_binary(*files[9],it.mRates.data(),it.mRates.size());
+      write_binary(*files[10],it.xCoord.data(),it.xCoord.size());
+      write_binary(*files[11],it.yCoord.data(),it.yCoord.size());
+      continue;
+    }
+    const double values[] = { it.sigma2, it.df, 0.0, it.qrateS2, it.mrateMu, it.mrateS2, it.pi, it.ll,
+			      (double)it.qRates.size(), (double)it.mRates.size() };
+    for ( int f = 0, k = 0 ; f < num_summary_files ; f++ ) {
+      for ( int j = 0 ; j < trace_ncols[f] ; j++, k++ ) {
+	*files[f] << values[k] << (j + 1 < trace_ncols[f] ? " " : "\n");
+	summaries[f].push_back(values[k]);
+      }
+    }
+    write_cell(*files[6],it.qRates);
+    write_cell(*files[7],it.wCoord);
+    write_cell(*files[8],it.zCoord);
+    write_cell(*files[9],it.mRates);
+    write_cell(*files[10],it.xCoord);
+    write_cell(*files[11],it.yCoord);
+  }
+  for ( int i = 0 ; i < num_trace_files ; i++ ) {
+    files[i]->flush();
+    check_condition(!files[i]->bad(), "Failed writing to " + mcmcpath + "/" + trace_files[i]);
+  }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "util.hpp"
+
+#include <deque>
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+
+#ifndef WRITER_H
+#define WRITER_H
+
+// The parameter values that are saved at each (thinned) MCMC iteration
+struct SavedIteration {
+  double sigma2, df;
+  double qrateS2, mrateMu, mrateS2;
+  double pi, ll;
+  VectorXd qRates, wCoord, zCoord; // one entry per q tile
+  VectorXd mRates, xCoord, yCoord; // one entry per m tile
+};
+
+/*
+  Write the saved MCMC iterations to mcmcpath as they are produced, rather than keeping them
+  in memory until the end of the run. EEMS::save_iteration adds each iteration to a chunk and
+  a background thread appends full chunks to the output files, so at most maxChunks chunks are
+  held in memory and the draws saved so far are on disk if the run is interrupted.
+  The output files are text files with one iteration per line and the values in fixed notation
+  with 6 decimals: mcmcthetas.txt, mcmcqhyper.txt, mcmcmhyper.txt, mcmcpilogl.txt (two values
+  per line), mcmcqtiles.txt and mcmcmtiles.txt (one value per line), written as matrices by dlmwrite,
+  and mcmcqrates.txt, mcmcwcoord.txt, mcmczcoord.txt, mcmcmrates.txt, mcmcxcoord.txt, mcmcycoord.txt
+  (one value per tile, each followed by a space).
+  dlmwrite pads the columns to the width of the widest value, which is only known at the end,
+  so the summary values (a few per iteration) are also kept and these six files are rewritten
+  with dlmwrite by close().
+
+  With the binary output format (outputFormat = binary), each file has the extension .bin instead
+  of .txt and consists of a 16-byte header followed by the values, in the same order as in the text
+  file, as little-endian 64-bit doubles. The header is the 8 characters "EEMSTRC1", the number of
+  values per iteration as a 32-bit integer (2 for mcmcthetas, mcmcqhyper, mcmcmhyper and mcmcpilogl;
+  1 for mcmcqtiles and mcmcmtiles; 0 for the other files, where the number of values per iteration
+  is the number of tiles given in mcmcqtiles or mcmcmtiles) and a 32-bit integer reserved for future use.
+  The number of iterations is determined by the file size. See read.trace in rEEMSplots.
+ */
+class TraceWriter {
+public:
+
+  TraceWriter(const string &mcmcpath, const bool binary = false, const int chunkSize = 100, const int maxChunks = 4);
+  ~TraceWriter( );
+
+  void push(const SavedIteration &iteration);
+  // Write the remaining iterations and wait for the background thread to finish
+  void close( );
+
+private:
+
+  typedef vector<SavedIteration> Chunk;
+
+  string mcmcpath;
+  bool binary;
+  int chunkSize, maxChunks;
+  Chunk chunk;               // the chunk that is being filled by push
+  std::deque<Chunk> queue;   // full chunks waiting to be written
+  bool done, opened;
+  boost::mutex mutex;
+  boost::condition_variable changed;
+  boost::thread thread;
+  vector<boost::shared_ptr<ofstream> > files;
+  vector<double> summaries[6]; // the values in the first six files, row by row (text format only)
+
+  void run( );
+  void open_files( );
+  void write_chunk(const Chunk &chunk);
+
+};
+
+#endif